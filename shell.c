@@ -29,13 +29,18 @@
 
  3.) If you wish to run a process in the background, append your commands
  with a '&' character, separated by a space. This character must be the last
- character in your input line. You cannot run piped commands in the
- background, or any internal command like "cd" or "exit."
+ character in your input line. Piped commands can run in the background
+ too, but not any internal command like "cd" or "exit." The shell prints
+ the job number and process group of a background job, and tells you when
+ it's done at the next prompt. "jobs" lists the background jobs.
       Example: sleep 5 &
+      Example: cat big.log | sort | uniq -c > counts.txt &
 
  4.) You may pipe the output of a command into another command using the '|'
- symbol, which will separate the two commands.
+ symbol, which will separate the two commands. Any number of commands can
+ be piped together.
       Example: "cat somefile.txt | more"
+      Example: "cat somefile.txt | sort | uniq -c | more"
 
  5.) You may specify to the shell that you want the output of your command to
  be redirected to a file. This is done by appending your command with the ">"
@@ -46,6 +51,10 @@
  filename argument) will also create a file with the specified name and write
  the output to it. However, if a file with the specified name already exists,
  it will not be deleted, but simply appended with the redirected output.
+ The shell keeps the last few files used with ">>" open, so a script that
+ appends to the same log over and over doesn't reopen it every time. Before
+ each use it checks that the name still points at the same file, so if the
+ log gets renamed, deleted or replaced, the next ">>" opens the new one.
 
   Example: "ls -l > sample.txt" -- creates a file sample.txt and writes the
   output of the ls -l command to it If sample.txt already exists in the
@@ -70,10 +79,109 @@
  file, as stdin in FD table for the parent process was overwritten and I
  couldn't find a way to reverse this.
 
+ 8.) When the shell is run from a terminal, pressing Tab completes the word
+ under the cursor. The first word of a line is completed against builtins and
+ every executable on $PATH; any other word (or a word containing a '/') is
+ completed as a file path. If there is more than one match and nothing more
+ can be filled in, the candidates are listed. Ctrl-U clears the line, Ctrl-C
+ throws it away, and Ctrl-D on an empty line exits the shell.
+
+ 9.) Prefixing a command with "memo" caches its result. The first time, the
+ command runs normally, and its stdout and exit status are saved in a cache
+ directory ($MEMO_DIR, or ~/.myshell_memo if that isn't set). After that,
+ running the same command just replays the saved output without running
+ anything. A result is reused only if all of these match: the arguments, the
+ working directory, the environment variables named in $MEMO_ENV (a ':'
+ separated list, PATH by default), and the size and modification time of
+ every file named by an argument or by a '<' redirection. Without a '<', the
+ command's stdin is /dev/null, since input typed at the terminal can't be
+ hashed. Only use this for commands that always give the same output for the
+ same input. stderr is not saved, and a command that couldn't be run at all
+ (not installed, say) isn't saved either. In a pipeline, "memo" goes in
+ front of the first command, and only that command is memoized; its saved
+ output is fed to the rest of the pipeline, which runs every time. A
+ memoized command can't be run in the background with '&'.
+      Example: "memo gcc -E big.c > big.i"
+      Example: "memo curl -s example.com | grep title"
+
+ 10.) Running the shell with "-d" ("./a.out -d") turns on diagnostics mode.
+ After every command line, the shell writes to stderr how many allocations
+ the line made, how many blocks and bytes are still allocated, and how many
+ file descriptors are open. Once the first line has warmed things up, those
+ numbers must never go above what they were then, apart from what the
+ shell's own tables hold (the $PATH index, aliases and functions, the ">>"
+ cache, background jobs and cached thread stacks), which each report their
+ size. If they grow, the shell reports it and aborts, so a leak is caught
+ right away instead of after a few weeks. Feed it a long file of mixed
+ commands to soak test it. soak.sh does that with a million generated lines
+ (or as many as you give it), and fails if the shell doesn't exit cleanly:
+      Example: "./a.out -d < commands.txt"
+      Example: "./soak.sh 5000000"
+
+ 11.) You can define your own aliases and functions. An alias replaces the
+ first word of a command with some other text, and a function runs a list
+ of commands separated by " ; ". In a function body, $1 through $9 are
+ replaced with the arguments the function was called with, $@ with all of
+ them, and $0 with the function's name. Typing "alias" or "function" by
+ itself lists what's defined. You can't redirect the output of a function.
+      Example: "alias ll=ls -l"
+      Example: "function build gcc -Wall $1.c -o $1 ; ./$1"
+
+ 12.) At startup the shell loads the aliases and functions in ~/.myshellrc
+ (or the file named by $MYSHELL_RC), one definition per line, written just
+ like above. Blank lines and lines starting with '#' are skipped. Parsing a
+ big rc file every time is slow, so the parsed definitions are saved next
+ to it in ~/.myshellrc.snap, and as long as the rc file hasn't changed,
+ later shells just mmap() the snapshot and look things up in it directly.
+
+ 13.) When the shell is run from a terminal, every command (or pipeline)
+ runs in its own process group, which is given the terminal while it runs.
+ (Reading a script from a file or a pipe, there's no terminal to hand
+ around, so commands just stay in the shell's group.) Ctrl-C and Ctrl-\ go to the whole
+ pipeline instead of killing the shell, and so do SIGINT, SIGQUIT and
+ SIGTERM sent to the shell itself while a pipeline is running. Ctrl-Z isn't
+ supported (there's no "fg" or "bg"), so a stopped job is just continued.
+ "$?" is replaced with the exit status of the last command, and
+ "$PIPESTATUS" with the exit status of every command in the last pipeline
+ (a command killed by a signal gets 128 + the signal number). Normally the
+ status of a pipeline is the status of its last command; after
+ "set -o pipefail" it is the status of the last command that failed, or 0
+ if none did. "set +o pipefail" turns that off, and "set" lists the options.
+      Example: "false | true" then "echo $? $PIPESTATUS" prints "0 1 0"
+
+ 14.) "set -o fastpipe" lets the shell run some simple pipeline stages
+ itself, in a thread, instead of starting a new process for them. This
+ saves a fork and an exec per stage. It only applies to commands after a
+ '|' that read their input from the pipe, and only to these forms:
+      grep [-v] [-c] PATTERN   (PATTERN is a plain string, no regex symbols)
+      wc -l   or   wc -c
+      head   or   head -n N   or   head -N
+ Anything else runs the real program like always. grep fails (status 2)
+ on a line longer than 64 MB, rather than use up all the shell's memory;
+ run the real grep (without fastpipe) for input like that. Once "head" has
+ printed its lines it closes the pipe, so the command feeding it gets
+ SIGPIPE and stops right away instead of running to the end.
+      Example: "cat big.log | grep ERROR | wc -l"
+
+ 15.) "jobs -v" shows how each command of each background job is doing:
+ its state, how much CPU it uses (CPU%, where 100 is one whole core), its
+ share of the job's CPU time, how fast it reads and writes, and how full
+ the pipe it reads from is. A stage whose input pipe is always full is the
+ bottleneck; a stage whose input is always empty is waiting on the one
+ before it. The numbers are for the time since the last look (or since the
+ job started). "jtop" shows the same thing over and over like top does:
+ "jtop -d SECS" sets how often (default 1), "jtop -n COUNT" stops after
+ COUNT updates, and "jtop -o FILE" also appends every sample to FILE as
+ tab separated columns, for looking at later. Press q to quit jtop. It
+ quits by itself once every job is done.
+      Example: "cat /dev/urandom | gzip | wc -c &" then "jtop"
+
  Author: Brett Bernardi
 
  */
 
+#define _GNU_SOURCE    // pipe2, malloc_usable_size, strndup
+
 #include "stdio.h"
 #include "string.h"
 #include <sys/types.h> // pid_t
@@ -83,6 +191,19 @@
 #include <malloc.h>    // malloc and realloc
 #include <fcntl.h>
 #include <errno.h>     // errno set upon functions being called
+#include <sys/stat.h>  // stat
+#include <sys/inotify.h> // inotify_init1, inotify_add_watch
+#include <dirent.h>    // opendir, readdir
+#include <termios.h>   // tcgetattr, tcsetattr (raw mode)
+#include <stdint.h>    // uint64_t
+#include <limits.h>    // PATH_MAX
+#include <sys/sendfile.h> // sendfile
+#include <sys/mman.h>  // mmap
+#include <signal.h>    // sigaction, kill
+#include <pthread.h>   // pthread_create, pthread_join
+#include <sys/ioctl.h> // FIONREAD
+#include <time.h>      // clock_gettime
+#include <poll.h>      // poll
 
 char *extractLine();
 int argCounter(char *buffer);
@@ -93,7 +214,8 @@ void exit_program();
 int getPipe(char **argArray);
 void external_process(char **argArray, int bg_flag);
 void argError();
-void pipeProcesses(char **argArray, int pipe_index);
+void pipeProcesses(char **argArray, int pipe_index, int bg_flag);
+char ***split_pipeline(char **argArray, int *count);
 int contains_cd(char **argArray);
 void cdCommand(char **argArray);
 struct fileRedirOutput *setup_redirection(char **argArray);
@@ -101,6 +223,56 @@ void redirect_output(char **argArray, int redir_index);
 void printArgArray(char **argArray);
 void redirect_input(char **argArray);
 struct fileRedirInput *setup_redirection_input(char **argArray);
+char *editLine();
+void build_path_index();
+void refresh_path_index();
+const char *lookup_command(const char *name);
+int exec_command(char **argArray, const char *cmd_path);
+void complete_word(char **buffer, int *length, int *capacity);
+int contains_memo(char **argArray);
+void memoCommand(char **argArray);
+int memo_lookup_or_run(char **command, char **argArray, int *status);
+struct symbol;
+void executeLine(char *buffer, int depth);
+int contains_definition(char **argArray);
+void defineSymbol(char **argArray);
+struct symbol *lookup_symbol(const char *name);
+void runAlias(struct symbol *sym, char **argArray, int depth);
+void runFunction(struct symbol *sym, char **argArray, int depth);
+void load_rc();
+void launch_job(char ***stages, int count, int bg_flag, int in_fd);
+void init_job_control();
+void enter_job(pid_t pgid, int foreground);
+void give_terminal(pid_t pgid);
+void signal_job(pid_t pgid, int sig);
+void take_terminal_back();
+int wait_for_stage(pid_t pid, pid_t pgid);
+int status_code(int wstatus);
+void record_status(int *statuses, int count);
+void expand_status(char **argArray);
+int contains_set(char **argArray);
+int setCommand(char **argArray);
+int cached_append_fd(const char *filename);
+int open_output_file();
+struct builtinStage;
+int parse_builtin_stage(char **argArray, struct builtinStage *stage);
+int open_stage_output();
+void *run_builtin_stage(void *arg);
+void add_job(pid_t pgid, char ***stages, pid_t *pids, int count);
+void reap_jobs();
+void report_finished_jobs();
+int contains_jobs(char **argArray);
+int jobsCommand(char **argArray);
+struct diagCounts;
+void diag_snapshot(struct diagCounts *counts);
+void diag_check_steady_state();
+int count_open_fds();
+void diag_add_block(struct diagCounts *held, void *p);
+void diag_tables_held(struct diagCounts *held);
+void path_index_held(struct diagCounts *held);
+void symbols_held(struct diagCounts *held);
+void output_cache_held(struct diagCounts *held);
+void jobs_held(struct diagCounts *held);
 
 
 struct fileRedirOutput {
@@ -111,6 +283,9 @@ struct fileRedirOutput {
     int index;
     // the filename to redirect output to
     char *filename;
+    // for ">>", the fd from the output cache the parent opened before
+    // forking. -1 if there isn't one.
+    int cached_fd;
 };
 
 // there will be one global struct containing information
@@ -138,9 +313,303 @@ struct fileRedirInput *fr_input;
 // It made sense to make this global
 int numArgs;
 
+// One executable found on $PATH. Used both for Tab completion and to skip
+// the $PATH search execvp() would otherwise do on every command.
+struct pathEntry {
+    // the name of the executable, e.g. "ls"
+    char *name;
+    // the full path of the executable, e.g. "/bin/ls"
+    char *path;
+    // position of the directory in $PATH. When two directories contain the
+    // same name, the one that comes first in $PATH wins (just like execvp)
+    int dir_order;
+};
+
+// The index of every executable on $PATH, sorted by name so a prefix can be
+// found with a binary search. It is built once, and after that it is only
+// rebuilt when inotify tells us one of the $PATH directories changed (or
+// $PATH itself changed). Scanning every directory on each Tab press is way
+// too slow.
+struct pathIndex {
+    struct pathEntry *entries;
+    int count;
+    int capacity;
+    // inotify instance watching every directory in $PATH, -1 if not built
+    int inotify_fd;
+    // copy of $PATH the index was built from
+    char *path_value;
+};
+
+struct pathIndex path_index = {NULL, 0, 0, -1, NULL};
+
+// Names of the builtin commands. These are offered by Tab completion along
+// with the executables on $PATH.
+const char *builtin_names[] = {"alias", "cd", "exit", "function", "jobs",
+                               "jtop", "memo", "set", NULL};
+
+// Set by the "-d" command line option. See rule 10 at the top of the file.
+int diag_mode = 0;
+
+// Allocation counters, kept up to date in diagnostics mode by the malloc()
+// family wrappers at the bottom of this file. Those wrappers see every
+// allocation in the process, including the ones made inside the C library
+// (strdup, fopen, opendir, ...). Updated atomically since threads may
+// allocate too.
+unsigned long diag_alloc_calls = 0;
+long diag_live_blocks = 0;
+long diag_live_bytes = 0;
+// The same, for the calling thread only. launch_job() uses these to see
+// what pthread_create() itself allocated.
+__thread long diag_thread_blocks = 0;
+__thread long diag_thread_bytes = 0;
+
+// What the counters looked like at the end of a main() loop iteration.
+struct diagCounts {
+    unsigned long alloc_calls;
+    long live_blocks;
+    long live_bytes;
+    int open_fds;
+};
+
+// the counts at the end of the first iteration, minus what the tables
+// held then (see diag_tables_held()). Every later iteration must end at or
+// below these, after taking off what the tables hold at that point.
+struct diagCounts diag_baseline;
+int diag_have_baseline = 0;
+// the counts at the end of the previous iteration, to print the deltas
+struct diagCounts diag_previous;
+// number of main() loop iterations so far
+unsigned long diag_iteration = 0;
+// What the C library has allocated for the threads of builtin stages and
+// not freed yet: it caches the stacks of finished threads for the next
+// ones, and frees the oldest when the cache gets too big. That happens
+// inside pthread_create() and pthread_join(), so launch_job() measures
+// both with the per-thread counters, and this goes up and down with the
+// real size of the cache.
+struct diagCounts thread_cache_held;
+
+#define SYMBOL_ALIAS 1
+#define SYMBOL_FUNCTION 2
+// number of buckets in the in-memory symbol table. Must be a power of 2.
+#define SYMBOL_BUCKETS 256
+// how deep functions and aliases can call each other before we give up
+#define MAX_CALL_DEPTH 64
+
+// A user defined alias or function. Aliases and functions share one name
+// space, so defining one replaces the other.
+struct symbol {
+    char *name;
+    // the replacement text of an alias, or the body of a function
+    char *value;
+    // SYMBOL_ALIAS or SYMBOL_FUNCTION
+    int kind;
+    // next symbol in the same hash bucket
+    struct symbol *next;
+};
+
+// The symbol table: symbols defined since the shell started, chained hash
+// table. These shadow anything with the same name in the rc snapshot.
+struct symbol *symbol_table[SYMBOL_BUCKETS];
+
+// the name of the alias being expanded right now (if any), so an alias
+// like "ls=ls -l" doesn't expand itself forever
+const char *expanding_alias = NULL;
+
+#define SNAPSHOT_MAGIC "MYSHSNAP"
+// bump this whenever the layout below changes, so old snapshots are ignored
+#define SNAPSHOT_VERSION 1
+
+// The rc snapshot file starts with this header. It's followed by an array
+// of bucket_count uint32_t offsets (from the start of the file) of the first
+// record in each hash bucket (0 for an empty bucket), and then the records.
+// The rc_ fields identify the rc file the snapshot was made from; if any of
+// them don't match the rc file now, the snapshot is stale.
+struct snapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t bucket_count;
+    uint64_t file_size;
+    uint64_t rc_size;
+    uint64_t rc_ino;
+    uint64_t rc_dev;
+    int64_t rc_mtime_sec;
+    int64_t rc_mtime_nsec;
+};
+
+// One symbol in the snapshot. Followed by the name and the value, each
+// terminated with a '\0', then padding up to a multiple of 4 bytes.
+struct snapshotRecord {
+    // offset of the next record in the same bucket, 0 at the end. It is
+    // always less than this record's offset.
+    uint32_t next;
+    uint32_t kind;
+    uint32_t name_len;
+    uint32_t value_len;
+};
+
+// the mmap()ed snapshot, or NULL if there isn't one
+const char *snapshot_map = NULL;
+size_t snapshot_size = 0;
+
+// 1 if stdin is a terminal, so the shell does job control with it
+int shell_interactive = 0;
+// the shell's own process group, which gets the terminal back after a job
+pid_t shell_pgid = 0;
+// process group of the job running in the foreground, 0 if there isn't
+// one. Read by the signal handler, hence the type.
+volatile sig_atomic_t foreground_pgid = 0;
+
+// most stages $PIPESTATUS remembers
+#define MAX_PIPE_STATUS 64
+
+// exit status of every stage of the last foreground job
+int pipe_status[MAX_PIPE_STATUS];
+int pipe_status_count = 0;
+// exit status of the last foreground job ($?)
+int last_status = 0;
+
+// "set -o pipefail"
+int pipefail = 0;
+// "set -o fastpipe"
+int fastpipe = 0;
+
+#define STAGE_EXTERNAL 0
+#define STAGE_GREP 1
+#define STAGE_WC 2
+#define STAGE_HEAD 3
+
+// size of the buffers a builtin stage reads and writes with
+#define STAGE_BUFFER_SIZE (256 * 1024)
+// the longest line grep will hold. grep fails on anything longer, so input
+// with no '\n' in it can't use up all the shell's memory.
+#define STAGE_MAX_LINE (256 * STAGE_BUFFER_SIZE)
+
+// A pipeline stage run by the shell itself in a thread (see rule 14).
+struct builtinStage {
+    // one of the STAGE_ constants. STAGE_EXTERNAL means a normal process.
+    int kind;
+    // where the stage reads from and writes to. The thread owns both and
+    // closes them when it's done.
+    int in_fd;
+    int out_fd;
+
+    // grep: the string to look for, and the -v and -c flags
+    const char *pattern;
+    size_t pattern_len;
+    int invert;
+    int count_only;
+    // wc: 'l' to count lines or 'c' to count bytes
+    char wc_mode;
+    // head: how many lines to let through
+    long limit;
+
+    // lines matched (grep), lines or bytes (wc) or lines passed (head)
+    long count;
+    // output waiting to be written
+    char *out;
+    size_t out_length;
+    // set if writing failed (usually because the reader went away)
+    int broken;
+    // set if the stage gave up, like grep on a line over STAGE_MAX_LINE
+    int failed;
+    // exit status, like the real program would give
+    int status;
+    pthread_t thread;
+};
+
+// how many ">>" files the output cache keeps open
+#define OUTPUT_CACHE_SIZE 8
+
+// A file kept open by the output cache. The key is the path plus the
+// device and inode it pointed at when it was opened, so if the path points
+// at a different file now (renamed, deleted, replaced, or a relative path
+// after a cd), the entry doesn't match anymore.
+struct outputCacheEntry {
+    // NULL if the entry is empty
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    // opened with O_APPEND | O_CLOEXEC
+    int fd;
+    // when it was last used, for throwing out the least recently used
+    unsigned long last_used;
+};
+
+struct outputCacheEntry output_cache[OUTPUT_CACHE_SIZE];
+unsigned long output_cache_clock = 0;
+
+// most background jobs at once
+#define MAX_JOBS 32
+
+// One command (stage) of a background job, and the last numbers sampled
+// for it (see sample_job()).
+struct jobStage {
+    pid_t pid;
+    // the command, for showing
+    char *command;
+    // set once the process has been reaped, along with its exit status
+    int done;
+    int status;
+
+    // state letter from /proc/<pid>/stat: R running, S sleeping (usually
+    // waiting on a pipe), D disk, T stopped, Z finished
+    char state;
+    // running totals at the last sample: CPU time in clock ticks, and
+    // bytes read and written. The io ones are -1 if they can't be read.
+    unsigned long long cpu_ticks;
+    long long read_bytes;
+    long long write_bytes;
+
+    // worked out from the last two samples
+    double cpu_percent;
+    double cpu_share;
+    double read_rate;
+    double write_rate;
+    // bytes waiting in the pipe this stage reads from, and how big that
+    // pipe is. -1 for the first stage, which doesn't read from a pipe.
+    int in_queued;
+    int in_capacity;
+};
+
+// A background job. A slot with id 0 is free.
+struct job {
+    int id;
+    pid_t pgid;
+    // the whole command line, for showing
+    char *command;
+    int count;
+    struct jobStage *stages;
+    // when the last sample was taken (the start of the job, at first)
+    struct timespec last_sample;
+};
+
+struct job job_table[MAX_JOBS];
+int next_job_id = 1;
+
+// The options "set" knows about, each with the flag it turns on and off.
+struct shellOption {
+    const char *name;
+    int *flag;
+};
+
+struct shellOption shell_options[] = {
+    {"fastpipe", &fastpipe},
+    {"pipefail", &pipefail},
+    {NULL, NULL}
+};
+
 
 int main(int argc, char **argv) {
 
+    // "-d" turns on diagnostics mode. Checked before anything is allocated
+    // (the banner's printf() allocates stdout's buffer), since only blocks
+    // allocated after this are counted.
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-d") == 0) {
+            diag_mode = 1;
+        }
+    }
+
 // Must use "\\" to print out a single "\" in printf()
 
     printf("--------------------------------------------------------------\n");
@@ -154,98 +623,176 @@ int main(int argc, char **argv) {
 
     // the line of user input to be parsed and tokenized
     char *buffer;
-    // an array of strings. holds each individual argument (token) input by user
-    char **argArray;
-    // index of the pipe in the argArray (if a pipe exits). If no pipe, set
-    // to -1.
-    int pipe_index = -1;
 
+    if (diag_mode) {
+        diag_snapshot(&diag_previous);
+    }
 
-    int contains_pipe;
-    // flag that will be flipped on if the '&' is contained within the user
-    // argument array
-    // default set to "off" or 0
-    int bg_flag = 0;
+    // take control of the terminal and set up signal forwarding
+    init_job_control();
 
-    int x = 0;
+    // load the user's functions and aliases
+    load_rc();
 
 
     // The main loop for the shell. Only breaks out if the "exit"
     // command is entered. 
     while (1) {
-        
+
+        // clean up any background processes that have finished. Otherwise
+        // every one of them stays around as a zombie until the shell exits.
+        reap_jobs();
+        report_finished_jobs();
+
         // the command line prompt
         write(1, "\n> ", 3);
 
-        // get the line of user input, count and tokenize
+        // get the line of user input and run it
         buffer = extractLine();
-        numArgs = argCounter(buffer);
-        argArray = tokenize(buffer, numArgs);
-
-        // first check for redirected input and set up global struct
-        fr_input = setup_redirection_input(argArray);
-        // check for redirected output symbols and set up the global struct
-        fr_output = setup_redirection(argArray);
+        executeLine(buffer, 0);
+        free(buffer);
 
-        if (contains_exit(argArray) == 1) {
-            exit_program();
+        if (diag_mode) {
+            diag_check_steady_state();
         }
 
-        if (contains_cd(argArray) == 1) {
-            cdCommand(argArray);
-        }
-        // At this point, the user is specifiying an external command
-        else {
-            // get index of pipe symbol (if doesn't exit it's -1)
-            pipe_index = getPipe(argArray);
+    }
 
-            // check for bg running symbol and set flag
-            bg_flag = (contains_ampersand(argArray) == 1)?  1:0;
+    return 0;
 
-            // add extra '\n' for external processes
-            // I want spacing to be consistent
-            if (fr_input->index == -1 && fr_output->index == -1) {
-                write(1,"\n",1);
-            }
-            
+}
 
-            if (pipe_index != -1) {
-                // user wants to pipe processes
-                pipeProcesses(argArray, pipe_index);
-            }
-                // non piped processes
-            else {
-                external_process(argArray, bg_flag);
-            }
+/*
+ * Runs one line of user input. This is the body of the main() loop, pulled
+ * out so that function bodies and aliases can run their commands the same
+ * way. depth is how many functions/aliases deep we are (0 for a line typed
+ * by the user), so a function that calls itself forever gets stopped.
+ * The buffer gets chopped up by tokenize(), and the caller frees it.
+ */
+void executeLine(char *buffer, int depth) {
+    // an array of strings. holds each individual argument (token) input by user
+    char **argArray;
+    // index of the pipe in the argArray (if a pipe exits). If no pipe, set
+    // to -1.
+    int pipe_index = -1;
 
-        }
+    // flag that will be flipped on if the '&' is contained within the user
+    // argument array
+    // default set to "off" or 0
+    int bg_flag = 0;
 
-        free(buffer);
+    // count and tokenize
+    numArgs = argCounter(buffer);
+    argArray = tokenize(buffer, numArgs);
+
+    // empty line, nothing to do
+    if (argArray[0] == NULL) {
         free(argArray);
+        return;
+    }
 
-        // only free if memory was allocated for either the
-        // struct pointer or the struct field filename char*.
-        if (fr_output->filename != NULL) {
-            free(fr_output->filename);
-        }
+    // Definitions and calls of functions and aliases are handled before
+    // anything else looks at the line, since a function body can have
+    // symbols like ">" or "exit" in it that must not be acted on yet.
+    if (contains_definition(argArray) == 1) {
+        defineSymbol(argArray);
+        free(argArray);
+        return;
+    }
 
-        if (fr_output != NULL) {
-            free(fr_output);
+    // replace $? and $PIPESTATUS. Done after definitions, so a function
+    // body gets the status from when it runs, not when it was defined.
+    expand_status(argArray);
+
+    struct symbol *sym = lookup_symbol(argArray[0]);
+    if (sym != NULL) {
+        if (depth >= MAX_CALL_DEPTH) {
+            write(1, "Functions/aliases nested too deep!\n", 35);
+        } else if (sym->kind == SYMBOL_ALIAS) {
+            runAlias(sym, argArray, depth);
+        } else {
+            runFunction(sym, argArray, depth);
         }
-        // only free if memory was allocated for either the
-        // struct pointer or the struct field filename char*.
-        if (fr_input->filename != NULL) {
-            free(fr_input->filename);
+        free(argArray);
+        return;
+    }
+
+    // first check for redirected input and set up global struct
+    fr_input = setup_redirection_input(argArray);
+    // check for redirected output symbols and set up the global struct
+    fr_output = setup_redirection(argArray);
+
+    if (contains_exit(argArray) == 1) {
+        exit_program();
+    }
+
+    // nothing left once the redirections are taken out, like "> f". None
+    // of the checks below expect that.
+    if (argArray[0] == NULL) {
+        argError();
+        int status = 1;
+        record_status(&status, 1);
+    }
+    else if (contains_memo(argArray) == 1) {
+        memoCommand(argArray);
+    }
+    else if (contains_jobs(argArray) == 1) {
+        int status = jobsCommand(argArray);
+        record_status(&status, 1);
+    }
+    else if (contains_set(argArray) == 1) {
+        int status = setCommand(argArray);
+        record_status(&status, 1);
+    }
+    else if (contains_cd(argArray) == 1) {
+        cdCommand(argArray);
+    }
+    // At this point, the user is specifiying an external command
+    else {
+        // get index of pipe symbol (if doesn't exit it's -1)
+        pipe_index = getPipe(argArray);
+
+        // check for bg running symbol and set flag
+        bg_flag = (contains_ampersand(argArray) == 1)?  1:0;
+
+        // add extra '\n' for external processes
+        // I want spacing to be consistent
+        if (fr_input->index == -1 && fr_output->index == -1) {
+            write(1,"\n",1);
         }
+        
 
-        if (fr_input != NULL) {
-            free(fr_input);
+        if (pipe_index != -1) {
+            // user wants to pipe processes
+            pipeProcesses(argArray, pipe_index, bg_flag);
+        }
+            // non piped processes
+        else {
+            external_process(argArray, bg_flag);
         }
 
     }
 
-    return 0;
+    free(argArray);
+
+    // only free if memory was allocated for either the
+    // struct pointer or the struct field filename char*.
+    if (fr_output->filename != NULL) {
+        free(fr_output->filename);
+    }
+
+    if (fr_output != NULL) {
+        free(fr_output);
+    }
+    // only free if memory was allocated for either the
+    // struct pointer or the struct field filename char*.
+    if (fr_input->filename != NULL) {
+        free(fr_input->filename);
+    }
 
+    if (fr_input != NULL) {
+        free(fr_input);
+    }
 }
 
 /*
@@ -263,6 +810,11 @@ int main(int argc, char **argv) {
  * getting input from file and reaching the end of the file.
  */
 char *extractLine() {
+    // a terminal gets the raw mode line editor (Tab completion etc.)
+    if (isatty(0)) {
+        return editLine();
+    }
+
     int buffer_capacity = 8;
     char *buffer;
     buffer = malloc(sizeof(char) * buffer_capacity);
@@ -274,7 +826,8 @@ char *extractLine() {
         // get a char from stdin
         // stdin is a file pointer (fp*) defined in stdio.h
         // that points to standard input stream
-        char c = getc(stdin);
+        // int, not char, otherwise EOF can't be told apart from a 0xFF byte
+        int c = getc(stdin);
         // check if char is a new line (enter pressed)
         if (c == '\n') {
             // Add terminating char at end of string buffer.
@@ -337,7 +890,8 @@ char **tokenize(char *buffer, int numArgs) {
     // each string(inner char array) in the (outer) array, as they will remain
     // stored in the memory location they are currently in (currently pointed
     // at by char* buffer).
-    argArray = malloc((sizeof(char *)) * numArgs + 1);
+    // one more than numArgs for the terminating NULL pointer
+    argArray = malloc((sizeof(char *)) * (numArgs + 1));
 
     /*
      * The C library function char* strtok(char *str, const char *delim)
@@ -398,8 +952,9 @@ int contains_ampersand(char **argArray) {
 struct fileRedirOutput *setup_redirection(char **argArray) {
     int i = 0;
     // allocate memory for struct
-    struct fileRedirOutput *s = malloc(sizeof(s));
+    struct fileRedirOutput *s = malloc(sizeof(*s));
     s->index = -1;
+    s->cached_fd = -1;
 
     for (char **p = argArray; *(p) != NULL; p++) {
         if (strcmp(*(p), ">") == 0) {
@@ -424,8 +979,8 @@ struct fileRedirOutput *setup_redirection(char **argArray) {
     }
 
     int x = strlen(argArray[s->index + 1]);
-    // alloate memory for char* (string) of fileName
-    s->filename = malloc(x * sizeof(char));
+    // alloate memory for char* (string) of fileName, plus one for the '\0'
+    s->filename = malloc((x + 1) * sizeof(char));
     strcpy(s->filename, argArray[s->index + 1]);
 
     // At this point redirection symbols were found, so we remove
@@ -457,25 +1012,32 @@ void redirect_output(char **argArray, int redir_index) {
 
 
     if (fr_output->numOfSymbols == 1) {
-        // make sure to remove redir symbol and replace with NULL pointer
-        // for use later
-        close(1);
         int output = open(fr_output->filename, O_CREAT | O_WRONLY | O_TRUNC,
                           0666);
 
-        //overwrite FD of stdout
+        //overwrite FD of stdout, then close the original so the file isn't
+        // left open twice
         dup2(output, 1);
+        if (output != 1) {
+            close(output);
+        }
+    } else if (fr_output->numOfSymbols == 2 && fr_output->cached_fd != -1) {
+        // the parent already has the file open in the output cache. The
+        // cached fd is O_CLOEXEC, so only the stdout copy survives the exec.
+        dup2(fr_output->cached_fd, 1);
     } else if (fr_output->numOfSymbols == 2) {
-        close(1);
-        // will create file if it does not exit and return a file pointer.
-        // If file exists, will return file pointer at end of file to append
-        // file. That's what "a" argument is for
-        FILE *f = fopen(fr_output->filename, "a");
-        // convert file pointer to file descriptor (int) using fileno() function
-        int output = fileno(f);
+        // will create file if it does not exit. If file exists, every write
+        // goes to the end of file to append file. That's what O_APPEND is
+        // for. (This used to be fopen(..., "a"), but the FILE* was never
+        // closed.)
+        int output = open(fr_output->filename, O_CREAT | O_WRONLY | O_APPEND,
+                          0666);
 
         //overwrite FD of stdout
         dup2(output, 1);
+        if (output != 1) {
+            close(output);
+        }
     } else {
         // shouldn't ever get here, but just in case
         argError();
@@ -505,9 +1067,12 @@ int contains_cd(char **argArray) {
  * only argument passed to function. 
  */
 void cdCommand(char **argArray) {
+    int status = 0;
     if (chdir(argArray[1]) != 0) {
         perror("ERROR");
+        status = 1;
     }
+    record_status(&status, 1);
 }
 
 /*
@@ -553,62 +1118,12 @@ int getPipe(char **argArray) {
  * Takes an array of strings, and the background flag, forks a child, and
  * overwrites the child's memory address with the commands in the string
  * array. If bg_flag is set to true, the parent process doesn't wait in the
- * background for the child to finish
+ * background for the child to finish. This is just a pipeline with one
+ * stage, so launch_job() does the work.
 */
 void external_process(char **argArray, int bg_flag) {
-    /*
-    * The execvp() takes the file name of the program you wish to use to over-
-    * write the caller process as the first argument, followed by an array of
-    * arguments supplied by the user to that program. This is opposed to
-    * execlp(), which takes each user argument as separate arguments. Char**
-    * array(array of strings) must be terminated with a NULL pointer.
-    * Instead of using the relative or absolute path of the desired program,
-    * members of the EXEC family of functions that contain a "p" in the name
-    * (like execvp) will search for the correct path given the correct
-    * program name. For example, simply using "ls" as the first argument, the
-    * function searches and finds /bin/ls. execvp() only returns if there
-    * was an error, and it returns a -1.
-    */
-
-    pid_t pid = fork();
-
-    // Child process
-    if (pid == 0) {
-
-        // checks if we are redirecting output of command
-        // The following must be done after the fork to only affect child.
-        if (fr_output->index != -1) {
-
-            redirect_output(argArray, fr_output->index);
-
-        }
-        // checks if there is redirected input
-        // If so, set it up
-        if (fr_input->index != -1) {
-            redirect_input(argArray);
-        }
-
-        if (execvp(argArray[0], argArray) == -1) {
-            // write to stderror which interprets the errno value
-            // When a function is called in C, a variable named as errno
-            // is automatically assigned a code (value) which can //be used
-            // to identify the type of error that has been encountered. Its
-            // a global variable indicating the error //occurred during any
-            // function call and defined in the header file errno.h.
-            perror("ERROR:");
-            exit(1);
-        }
-    }
-        // parent process
-    else {
-        // if bg_flag is false
-        // don't run in background
-        if (bg_flag != 1) {
-            wait(NULL); // wait for child to terminate
-        }
-
-    }
-
+    char **stages[1] = {argArray};
+    launch_job(stages, 1, bg_flag, -1);
 }
 
 /*
@@ -620,141 +1135,305 @@ void argError() {
 
 /*
  * Preconditions: User commands as an array of strings (char**) containing
- * two external commands separated by the '|' pipe symbol, at the specified
- * pipe_index.
+ * external commands separated by the '|' pipe symbol, the first of which is
+ * at the specified pipe_index.
  *
- * The output of the command on the left of the '|' will be piped
- * into the input of the second command. This function will separate the
- * commands on the left and right side of the pipe. The pipe will be set up
- * before any forking, and there will be two child processes needed, as
- * simply using one child and the parent will result in the shell(the parent)
- * terminating after execution. In other words, we don't want to use the
- * parent to execute any external commands(with execvp), as we can never gain
- * control back and continue with the shell. Uses the global numArgs variable.
- */
-void pipeProcesses(char **argArray, int pipe_index) {
-    // output goes to pipe
-    char **first_command = malloc(
-            sizeof(char *) * (pipe_index + 1));
-    // input goes to pipe
-    char **second_command = malloc(sizeof(char *) * (numArgs -
-                                                     pipe_index));
-
-    // array of file descriptors
-    int fd[2];
-    pid_t pid;
-
-    for (int i = 0; i < pipe_index; i++) {
-        first_command[i] = argArray[i];
+ * The output of each command will be piped into the input of the next one.
+ * This function separates the commands (see split_pipeline()) and then
+ * hands them to launch_job(). There is one child process per command, as
+ * we don't want to use the parent to execute any external commands(with
+ * execvp), as we can never gain control back and continue with the shell.
+ * If bg_flag is 1 the pipeline runs in the background.
+ */
+void pipeProcesses(char **argArray, int pipe_index, int bg_flag) {
+    int count;
+    char ***stages = split_pipeline(argArray, &count);
+    if (stages == NULL) {
+        argError();
+        return;
     }
 
-    *(first_command + pipe_index) = NULL;
-
-    int k = pipe_index + 1;
-
-    for (int j = 0; j <= (numArgs - pipe_index - 1); j++) {
-        if (j == (numArgs - pipe_index - 1)) {
-            second_command[j] = NULL; // add null pointer at end of array
-        } else {
-            second_command[j] = argArray[j + pipe_index + 1];
+    // "memo" only works on the first command (see memoCommand()). Any
+    // later one reads a pipe, and there's no way to hash that.
+    for (int i = 1; i < count; i++) {
+        if (strcmp(stages[i][0], "memo") == 0) {
+            argError();
+            free(stages);
+            return;
         }
-
     }
 
-    pipe(fd); // sets up pipe in kernel space and adds file descriptors to
-    // the fd[] array argument.
-
-    pid = fork(); // fork current process
+    launch_job(stages, count, bg_flag, -1);
+    free(stages);
+}
 
-    // error checking
-    if(pid < 0) {
-      write(1, "Error creating process!\n", 24);
+/*
+ * Separates the commands of a pipeline by replacing every '|' in argArray
+ * with a NULL pointer, so each command becomes its own NULL terminated
+ * array inside argArray. Returns a malloc()ed array pointing at the start
+ * of each command and sets count to how many there are, or returns NULL if
+ * there is a pipe with nothing on one side of it.
+ */
+char ***split_pipeline(char **argArray, int *count) {
+    // there's one more command than there are pipes
+    *count = 1;
+    for (char **p = argArray; *(p) != NULL; p++) {
+        if (strcmp(*(p), "|") == 0) {
+            (*count)++;
+        }
     }
 
-    // At this point, there are two processes, and each have their own pid
-    // variable. The child pid variable is set to 0, while the parent's pid
-    // variable is set to the PID of the child. The child process begins
-    // execution at this exact point where the fork was called, as the code
-    // and PC register was copied exactly from the parent. We can use this to
-    // differentiate between the two processes.
+    char ***stages = malloc(sizeof(char **) * (*count));
+    int stage = 0;
+    stages[stage++] = argArray;
+    for (char **p = argArray; *(p) != NULL; p++) {
+        if (strcmp(*(p), "|") == 0) {
+            *(p) = NULL;
+            stages[stage++] = p + 1;
+        }
+    }
 
-    // if true, this process is the first child.
-    if (pid == 0) {
-        // overwrite slot 1 (stdout) of FD table of child process with the
-        // write end of the pipe. Child's process will write to pipe instead
-        // of stdout
-        dup2(fd[1], 1);
+    // a pipe with nothing on one side of it
+    for (int i = 0; i < *count; i++) {
+        if (stages[i][0] == NULL) {
+            free(stages);
+            return NULL;
+        }
+    }
+    return stages;
+}
 
-        // close read end of pipe
-        close(fd[0]);
+/*
+ * Runs a job: one or more commands (stages), each a NULL terminated array
+ * of strings, with the output of each stage piped into the next. Redirected
+ * input goes to the first stage and redirected output to the last one.
+ *
+ * If the shell is interactive, every stage goes into one new process group,
+ * with the first child as the group leader (otherwise there's no terminal
+ * to hand over, and pgid is just the pid of the first child). For a
+ * foreground job the group is given the terminal with
+ * tcsetpgrp(), so Ctrl-C and friends go to the job and not to the shell,
+ * and any SIGINT/SIGQUIT/SIGTERM sent to the shell itself is forwarded to
+ * the whole group (see forward_signal()). Once every stage is done the
+ * terminal goes back to the shell and the exit status of every stage is
+ * recorded (see record_status()). If bg_flag is 1 the job gets its own
+ * group but not the terminal, and we don't wait for it. With "set -o
+ * fastpipe", stages after the first one that the shell knows how to run
+ * itself are run in threads instead of processes (see rule 14). If in_fd
+ * isn't -1, the first stage reads from it instead of from the terminal or
+ * a '<' file, and launch_job() closes it.
+ */
+void launch_job(char ***stages, int count, int bg_flag, int in_fd) {
+    /*
+    * The execvp() takes the file name of the program you wish to use to over-
+    * write the caller process as the first argument, followed by an array of
+    * arguments supplied by the user to that program. This is opposed to
+    * execlp(), which takes each user argument as separate arguments. Char**
+    * array(array of strings) must be terminated with a NULL pointer.
+    * Instead of using the relative or absolute path of the desired program,
+    * members of the EXEC family of functions that contain a "p" in the name
+    * (like execvp) will search for the correct path given the correct
+    * program name. For example, simply using "ls" as the first argument, the
+    * function searches and finds /bin/ls. execvp() only returns if there
+    * was an error, and it returns a -1.
+    */
 
-        if (execvp(first_command[0], first_command) == -1) {
-            perror("ERROR");
-            exit(1);
+    pid_t *pids = malloc(sizeof(pid_t) * count);
+    int *statuses = malloc(sizeof(int) * count);
+    const char **paths = malloc(sizeof(char *) * count);
+    struct builtinStage *builtins = malloc(sizeof(struct builtinStage) *
+                                           count);
+
+    // which stages can the shell run itself? Never the first one, since it
+    // doesn't read from a pipe and it leads the process group.
+    for (int i = 0; i < count; i++) {
+        if (!(fastpipe && i > 0 && !bg_flag &&
+              parse_builtin_stage(stages[i], &builtins[i]))) {
+            builtins[i].kind = STAGE_EXTERNAL;
         }
+    }
 
+    // ">>" files come from the output cache, opened here in the parent so
+    // they stay open for the next command
+    if (fr_output->numOfSymbols == 2) {
+        fr_output->cached_fd = cached_append_fd(fr_output->filename);
     }
-        // The parent process.
-    else {
 
-        // fork again
-        pid_t pid2 = fork();
+    // look the commands up in the $PATH index before forking, so the lookup
+    // (and the index itself) stays in the parent for the next command. The
+    // index is refreshed once for the whole job, so none of the lookups can
+    // rebuild it and free a path found by an earlier one.
+    refresh_path_index();
+    for (int i = 0; i < count; i++) {
+        paths[i] = lookup_command(stages[i][0]);
+    }
 
-        // error checking
-        if(pid2 < 0) {
-        write(1, "Error creating process!\n", 24);
+    pid_t pgid = 0;
+    // in_fd is the read end of the pipe coming from the previous stage from
+    // here on
+    int started = 0;
+
+    for (int i = 0; i < count; i++) {
+        // array of file descriptors
+        int fd[2] = {-1, -1};
+        if (i < count - 1) {
+            pipe2(fd, O_CLOEXEC); // sets up pipe in kernel space and adds
+            // file descriptors to the fd[] array argument. O_CLOEXEC closes
+            // them in any process that exec()s, so only the dup2() copies
+            // get inherited.
         }
 
-        // The parent process now has two children, and the parent's pid and
-        // pid2 variables contain the PID of its first and second child
-        // processes, respectively.
-
-        // second child
-        if (pid2 == 0) {
+        if (builtins[i].kind != STAGE_EXTERNAL) {
+            // the thread is started once everything is forked. It owns
+            // these fds from now on.
+            builtins[i].in_fd = in_fd;
+            builtins[i].out_fd = (fd[1] != -1) ? fd[1] : open_stage_output();
+            if (builtins[i].out_fd == -1) {
+                builtins[i].out_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+            }
+            pids[i] = 0;
+            started++;
+            in_fd = fd[0];
+            continue;
+        }
 
-            // after forking but before using execvp, check for
-            // redirected output and call function if necessary
-            if (fr_output->index != -1) {
+        pid_t pid = fork(); // fork current process
 
-                redirect_output(argArray, fr_output->index);
+        // error checking
+        if (pid < 0) {
+            write(1, "Error creating process!\n", 24);
+            if (fd[0] != -1) {
+                close(fd[0]);
+                close(fd[1]);
+            }
+            break;
+        }
 
+        // At this point, there are two processes, and each have their own
+        // pid variable. The child pid variable is set to 0, while the
+        // parent's pid variable is set to the PID of the child. The child
+        // process begins execution at this exact point where the fork was
+        // called, as the code and PC register was copied exactly from the
+        // parent. We can use this to differentiate between the two processes.
+        if (pid == 0) {
+            enter_job(pgid, !bg_flag);
+
+            // overwrite slot 0 (stdin) of the FD table with the read end of
+            // the previous pipe, or the redirected input file for the first
+            // stage
+            if (in_fd != -1) {
+                dup2(in_fd, 0);
+            } else if (fr_input->index != -1) {
+                redirect_input(stages[i]);
             }
 
-            // overwrite 0 (stdin) slot on FD table to the read end of the pipe
-            dup2(fd[0], 0);
-            // close write end of pipe
-            close(fd[1]);
+            // overwrite slot 1 (stdout) with the write end of the next pipe,
+            // or the redirected output file for the last stage
+            if (fd[1] != -1) {
+                dup2(fd[1], 1);
+            } else if (fr_output->index != -1) {
+                redirect_output(stages[i], fr_output->index);
+            }
 
-            // instead of taking input from stdin, this child will get input
-            // from the read end of the pipe (coming from the child process)
-            if (execvp(second_command[0], second_command) == -1) {
+            if (exec_command(stages[i], paths[i]) == -1) {
                 // write to stderror which interprets the errno value
                 // When a function is called in C, a variable named as errno
                 // is automatically assigned a code (value) which can be used
-                // to identify the type of error that has been encountered. Its
-                // a global variable indicating the error that occurred
-                // during any function call and defined in the header file
-                // errno.h.
+                // to identify the type of error that has been encountered.
                 perror("ERROR");
-                exit(1);
+                // _exit(), not exit(). exit() flushes the stdio buffers
+                // copied from the shell, and flushing stdin seeks the shared
+                // fd back, so the shell would read the same input lines all
+                // over again.
+                _exit(1);
             }
-        } else {
-            // parent must also close their end of the pipe.
-            // This is absolutely crucial, otherwise the second child process
-            // will wait until the parent is terminated to output its data.
-            close(fd[0]);
+        }
+
+        // The parent process. Put the child in the job's group here too,
+        // since we can't know whether the child or the parent gets to run
+        // first.
+        if (pgid == 0) {
+            pgid = pid;
+        }
+        if (shell_interactive) {
+            setpgid(pid, pgid);
+        }
+        if (i == 0 && !bg_flag) {
+            give_terminal(pgid);
+        }
+        pids[i] = pid;
+        started++;
+
+        // parent must also close their ends of the pipes.
+        // This is absolutely crucial, otherwise the next child process
+        // will wait until the parent is terminated to output its data.
+        if (in_fd != -1) {
+            close(in_fd);
+        }
+        if (fd[1] != -1) {
             close(fd[1]);
+        }
+        in_fd = fd[0];
+    }
+    if (in_fd != -1) {
+        close(in_fd);
+    }
 
-            waitpid(pid, NULL, 0); // wait for 1st child
-            waitpid(pid2, NULL, 0); // wait for 2nd child
+    // start the builtin stages. Waiting until now means no child gets
+    // forked while one of the threads is running.
+    for (int i = 0; i < started; i++) {
+        if (builtins[i].kind == STAGE_EXTERNAL) {
+            continue;
+        }
+        // see thread_cache_held
+        long blocks = diag_thread_blocks;
+        long bytes = diag_thread_bytes;
+        int created = pthread_create(&builtins[i].thread, NULL,
+                                     run_builtin_stage, &builtins[i]);
+        thread_cache_held.live_blocks += diag_thread_blocks - blocks;
+        thread_cache_held.live_bytes += diag_thread_bytes - bytes;
+        if (created != 0) {
+            // no thread, so the stage fails. Closing its fds lets the
+            // stages on either side of it finish.
+            perror("ERROR");
+            close(builtins[i].in_fd);
+            close(builtins[i].out_fd);
+            builtins[i].kind = STAGE_EXTERNAL;
+            pids[i] = 0;
+        }
+    }
 
+    if (!bg_flag) {
+        for (int i = 0; i < started; i++) {
+            if (builtins[i].kind != STAGE_EXTERNAL) {
+                long blocks = diag_thread_blocks;
+                long bytes = diag_thread_bytes;
+                pthread_join(builtins[i].thread, NULL);
+                thread_cache_held.live_blocks += diag_thread_blocks - blocks;
+                thread_cache_held.live_bytes += diag_thread_bytes - bytes;
+                statuses[i] = builtins[i].status;
+            } else if (pids[i] == 0) {
+                // a builtin stage that couldn't be started
+                statuses[i] = 1;
+            } else {
+                statuses[i] = status_code(wait_for_stage(pids[i], pgid));
+            }
+        }
+        // a stage that couldn't even be started failed
+        for (int i = started; i < count; i++) {
+            statuses[i] = 1;
         }
 
+        take_terminal_back();
+        record_status(statuses, count);
+    } else if (started > 0) {
+        add_job(pgid, stages, pids, started);
     }
-    // free memory from both arrays
-    free(first_command);
-    free(second_command);
 
+    free(paths);
+    free(builtins);
+    free(statuses);
+    free(pids);
 }
 
 /**
@@ -780,7 +1459,7 @@ void printArgArray(char **argArray) {
 struct fileRedirInput *setup_redirection_input(char **argArray) {
     int i = 0;
     // allocate memory for struct
-    struct fileRedirInput *s = malloc(sizeof(s));
+    struct fileRedirInput *s = malloc(sizeof(*s));
     s->index = -1;
 
     for (char **p = argArray; *(p) != NULL; p++) {
@@ -801,8 +1480,8 @@ struct fileRedirInput *setup_redirection_input(char **argArray) {
     }
 
     int x = strlen(argArray[s->index + 1]);
-    // alloate memory for char* (string) of fileName
-    s->filename = malloc(x * sizeof(char));
+    // alloate memory for char* (string) of fileName, plus one for the '\0'
+    s->filename = malloc((x + 1) * sizeof(char));
     strcpy(s->filename, argArray[s->index + 1]);
 
     // At this point redirection symbols were found, so we remove
@@ -829,15 +1508,15 @@ void redirect_input(char **argArray) {
     if (fr_input->numOfSymbols == 1) {
         // make sure to remove redir symbol and replace with NULL pointer
         // for use later
-        close(0);
-        int input = open(fr_input->filename, 0);
+        int input = open(fr_input->filename, O_RDONLY);
         // open the file supplied in redirected input command
         if (input != -1) {
             // replace stdin in FD table with file descriptor from opened file
             dup2(input, 0);
+            close(input);
         } else {
             perror("ERROR OPENING FILE");
-            exit(1);
+            _exit(1);
         }
 
 
@@ -846,4 +1525,2779 @@ void redirect_input(char **argArray) {
         argError();
     }
 
-}
\ No newline at end of file
+}
+/*
+ * Used by qsort() to sort the $PATH index. Sorts by name, and when two
+ * entries have the same name, by the position of their directory in $PATH.
+ */
+int compare_path_entries(const void *a, const void *b) {
+    const struct pathEntry *x = a;
+    const struct pathEntry *y = b;
+    int c = strcmp(x->name, y->name);
+    if (c != 0) {
+        return c;
+    }
+    return x->dir_order - y->dir_order;
+}
+
+/*
+ * Throws away the old $PATH index (if there is one), scans every directory
+ * in $PATH for executables and builds a new sorted index. Also starts a new
+ * inotify instance watching each of the directories, so refresh_path_index()
+ * knows when the index goes stale without scanning anything.
+ */
+void build_path_index() {
+    for (int i = 0; i < path_index.count; i++) {
+        free(path_index.entries[i].name);
+        free(path_index.entries[i].path);
+    }
+    path_index.count = 0;
+    free(path_index.path_value);
+    path_index.path_value = NULL;
+
+    if (path_index.inotify_fd != -1) {
+        close(path_index.inotify_fd);
+    }
+    // non-blocking so refresh_path_index() can check for events for free
+    path_index.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    char *path = getenv("PATH");
+    if (path == NULL) {
+        path = "/usr/local/bin:/usr/bin:/bin";
+    }
+    path_index.path_value = strdup(path);
+
+    // strtok() writes into the string, so work on a copy
+    char *dirs = strdup(path);
+    int dir_order = 0;
+
+    for (char *dir = strtok(dirs, ":"); dir != NULL; dir = strtok(NULL, ":")) {
+        DIR *d = opendir(dir);
+        if (d == NULL) {
+            continue;
+        }
+        if (path_index.inotify_fd != -1) {
+            // anything that adds, removes or renames an executable
+            inotify_add_watch(path_index.inotify_fd, dir,
+                              IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                              IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF |
+                              IN_MOVE_SELF);
+        }
+
+        struct dirent *e;
+        while ((e = readdir(d)) != NULL) {
+            if (e->d_name[0] == '.') {
+                continue;
+            }
+            char *full = malloc(strlen(dir) + strlen(e->d_name) + 2);
+            sprintf(full, "%s/%s", dir, e->d_name);
+
+            // stat() follows symlinks, which is what we want, since half of
+            // /usr/bin is symlinks
+            struct stat st;
+            if (stat(full, &st) != 0 || !S_ISREG(st.st_mode) ||
+                (st.st_mode & 0111) == 0) {
+                free(full);
+                continue;
+            }
+
+            if (path_index.count >= path_index.capacity) {
+                path_index.capacity = (path_index.capacity == 0) ?
+                                      256 : path_index.capacity * 2;
+                path_index.entries = realloc(path_index.entries,
+                                             sizeof(struct pathEntry) *
+                                             path_index.capacity);
+            }
+            struct pathEntry *p = &path_index.entries[path_index.count];
+            p->name = strdup(e->d_name);
+            p->path = full;
+            p->dir_order = dir_order;
+            path_index.count++;
+        }
+        closedir(d);
+        dir_order++;
+    }
+    free(dirs);
+
+    qsort(path_index.entries, path_index.count, sizeof(struct pathEntry),
+          compare_path_entries);
+
+    // remove duplicate names. Since equal names are sorted by dir_order, the
+    // first one of each run is the one execvp() would have found.
+    int kept = 0;
+    for (int i = 0; i < path_index.count; i++) {
+        if (kept > 0 &&
+            strcmp(path_index.entries[kept - 1].name,
+                   path_index.entries[i].name) == 0) {
+            free(path_index.entries[i].name);
+            free(path_index.entries[i].path);
+            continue;
+        }
+        path_index.entries[kept] = path_index.entries[i];
+        kept++;
+    }
+    path_index.count = kept;
+}
+
+/*
+ * Makes sure the $PATH index is up to date. Builds it the first time, and
+ * rebuilds it if $PATH was changed or if inotify has reported anything
+ * happening in one of the directories. Otherwise this is one non-blocking
+ * read() that returns EAGAIN, which is much cheaper than rescanning.
+ */
+void refresh_path_index() {
+    char *path = getenv("PATH");
+    if (path == NULL) {
+        path = "/usr/local/bin:/usr/bin:/bin";
+    }
+
+    if (path_index.path_value == NULL ||
+        strcmp(path, path_index.path_value) != 0) {
+        build_path_index();
+        return;
+    }
+
+    if (path_index.inotify_fd == -1) {
+        return;
+    }
+
+    // drain every pending event. We don't care what the events are, just
+    // that there were some.
+    char events[4096];
+    int changed = 0;
+    while (read(path_index.inotify_fd, events, sizeof(events)) > 0) {
+        changed = 1;
+    }
+    if (changed) {
+        build_path_index();
+    }
+}
+
+/*
+ * Adds the memory and fds held by the $PATH index to held, for diagnostics
+ * mode.
+ */
+void path_index_held(struct diagCounts *held) {
+    for (int i = 0; i < path_index.count; i++) {
+        diag_add_block(held, path_index.entries[i].name);
+        diag_add_block(held, path_index.entries[i].path);
+    }
+    diag_add_block(held, path_index.entries);
+    diag_add_block(held, path_index.path_value);
+    if (path_index.inotify_fd != -1) {
+        held->open_fds++;
+    }
+}
+
+/*
+ * Finds the first entry in the $PATH index whose name starts with prefix,
+ * using a binary search. Returns the index of the entry, or
+ * path_index.count if nothing is >= prefix.
+ */
+int lower_bound_prefix(const char *prefix) {
+    int lo = 0;
+    int hi = path_index.count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(path_index.entries[mid].name, prefix) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * Looks up a command name in the $PATH index and returns the full path of
+ * the executable, or NULL if it isn't there. Names containing a '/' are
+ * paths already and always return NULL. The returned string belongs to the
+ * index, so it's only good until the next refresh_path_index(). This never
+ * refreshes the index itself: the caller does that once before looking up
+ * all the commands of a line, so looking up one can't free another.
+ */
+const char *lookup_command(const char *name) {
+    if (name == NULL || strchr(name, '/') != NULL) {
+        return NULL;
+    }
+
+    int i = lower_bound_prefix(name);
+    if (i < path_index.count && strcmp(path_index.entries[i].name, name) == 0) {
+        return path_index.entries[i].path;
+    }
+    return NULL;
+}
+
+/*
+ * Overwrites the calling (child) process with the command in argArray. If
+ * the parent found the command in the $PATH index, cmd_path is its full path
+ * and execv() is used directly with no searching. If cmd_path is NULL, or
+ * the file has vanished since the index was built, falls back to execvp().
+ * execvp() is also used for a script with no "#!" line (ENOEXEC), since it
+ * knows to run those with /bin/sh and execv() doesn't. Like the exec
+ * functions, this only returns if there was an error, and it returns a -1.
+ */
+int exec_command(char **argArray, const char *cmd_path) {
+    if (cmd_path != NULL) {
+        execv(cmd_path, argArray);
+        if (errno != ENOENT && errno != ENOEXEC) {
+            return -1;
+        }
+    }
+    if (argArray[0] == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    return execvp(argArray[0], argArray);
+}
+
+/*
+ * Appends len chars of str to the end of the line being edited, growing the
+ * buffer by doubling it just like extractLine() does, and echoes the chars
+ * to the terminal.
+ */
+void append_to_line(char **buffer, int *length, int *capacity,
+                    const char *str, int len) {
+    while (*length + len + 1 > *capacity) {
+        *capacity *= 2;
+        *buffer = realloc(*buffer, sizeof(char) * (*capacity));
+    }
+    memcpy(*buffer + *length, str, len);
+    *length += len;
+    (*buffer)[*length] = '\0';
+    write(1, str, len);
+}
+
+/*
+ * Raw mode version of extractLine(), used when stdin is a terminal. The
+ * terminal is taken out of canonical mode so we see each key as it is
+ * pressed, which is the only way to catch Tab. Echoing is done by hand.
+ * Supported keys: printable chars, Backspace, Tab (completion), Enter,
+ * Ctrl-U (clear line), Ctrl-C (throw the line away) and Ctrl-D (exit on an
+ * empty line). Arrow keys and other escape sequences are ignored.
+ */
+char *editLine() {
+    struct termios cooked;
+    struct termios raw;
+    tcgetattr(0, &cooked);
+    raw = cooked;
+    // no line buffering, no echo, and Ctrl-C/Ctrl-Z come through as plain
+    // chars instead of signals
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    // TCSADRAIN, not TCSAFLUSH, which would throw away anything typed
+    // ahead while the last command was running
+    tcsetattr(0, TCSADRAIN, &raw);
+
+    int capacity = 8;
+    int length = 0;
+    char *buffer = malloc(sizeof(char) * capacity);
+    buffer[0] = '\0';
+
+    while (1) {
+        char c;
+        if (read(0, &c, 1) != 1) {
+            // terminal went away
+            tcsetattr(0, TCSADRAIN, &cooked);
+            exit(0);
+        }
+
+        if (c == '\n' || c == '\r') {
+            write(1, "\n", 1);
+            break;
+        } else if (c == '\t') {
+            complete_word(&buffer, &length, &capacity);
+        } else if (c == 127 || c == '\b') {
+            if (length > 0) {
+                length--;
+                buffer[length] = '\0';
+                write(1, "\b \b", 3);
+            }
+        } else if (c == 21) { // Ctrl-U
+            while (length > 0) {
+                write(1, "\b \b", 3);
+                length--;
+            }
+            buffer[0] = '\0';
+        } else if (c == 3) { // Ctrl-C
+            write(1, "^C\n> ", 5);
+            length = 0;
+            buffer[0] = '\0';
+        } else if (c == 4) { // Ctrl-D
+            if (length == 0) {
+                tcsetattr(0, TCSADRAIN, &cooked);
+                free(buffer);
+                exit_program();
+            }
+        } else if (c == 27) { // escape sequence, e.g. an arrow key
+            char seq[2];
+            if (read(0, &seq[0], 1) == 1 && (seq[0] == '[' || seq[0] == 'O')) {
+                // swallow everything up to the final letter of the sequence
+                while (read(0, &seq[1], 1) == 1 &&
+                       !((seq[1] >= 'A' && seq[1] <= 'Z') ||
+                         (seq[1] >= 'a' && seq[1] <= 'z') || seq[1] == '~')) {
+                }
+            }
+        } else if ((unsigned char) c >= 32) {
+            append_to_line(&buffer, &length, &capacity, &c, 1);
+        }
+    }
+
+    tcsetattr(0, TCSADRAIN, &cooked);
+    return buffer;
+}
+
+/*
+ * Used by qsort() to sort the file names offered by path completion.
+ */
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/*
+ * Completes the last word of the line being edited when Tab is pressed.
+ * The first word on the line is completed from the builtins and the $PATH
+ * index. Anything else is completed as a file name by reading the directory
+ * it's in. One match gets filled in completely (followed by a space, or a
+ * '/' for a directory). More than one match gets filled in as far as they
+ * all agree, and if that adds nothing, all the matches are listed and the
+ * prompt is redrawn.
+ */
+void complete_word(char **buffer, int *length, int *capacity) {
+    // find where the last word starts
+    int start = *length;
+    while (start > 0 && (*buffer)[start - 1] != ' ') {
+        start--;
+    }
+    char *word = strdup(*buffer + start);
+
+    int first_word = 1;
+    for (int i = 0; i < start; i++) {
+        if ((*buffer)[i] != ' ') {
+            first_word = 0;
+            break;
+        }
+    }
+
+    // every candidate is a full replacement for the word. is_dir says if it
+    // should be followed by '/' instead of ' ' when it's the only match.
+    int count = 0;
+    int cap = 16;
+    char **matches = malloc(sizeof(char *) * cap);
+    char *is_dir = malloc(sizeof(char) * cap);
+
+    if (first_word && strchr(word, '/') == NULL) {
+        for (const char **b = builtin_names; *b != NULL; b++) {
+            if (strncmp(*b, word, strlen(word)) == 0) {
+                if (count >= cap) {
+                    cap *= 2;
+                    matches = realloc(matches, sizeof(char *) * cap);
+                    is_dir = realloc(is_dir, sizeof(char) * cap);
+                }
+                matches[count] = strdup(*b);
+                is_dir[count] = 0;
+                count++;
+            }
+        }
+        refresh_path_index();
+        size_t word_len = strlen(word);
+        for (int i = lower_bound_prefix(word); i < path_index.count &&
+             strncmp(path_index.entries[i].name, word, word_len) == 0; i++) {
+            if (count >= cap) {
+                cap *= 2;
+                matches = realloc(matches, sizeof(char *) * cap);
+                is_dir = realloc(is_dir, sizeof(char) * cap);
+            }
+            matches[count] = strdup(path_index.entries[i].name);
+            is_dir[count] = 0;
+            count++;
+        }
+    } else {
+        // split the word into the directory part and the name part
+        char *slash = strrchr(word, '/');
+        char *dir;
+        char *base;
+        int dir_len;
+        if (slash == NULL) {
+            dir = strdup(".");
+            base = word;
+            dir_len = 0;
+        } else {
+            dir_len = slash - word + 1;
+            dir = strndup(word, dir_len);
+            base = slash + 1;
+        }
+
+        DIR *d = opendir(dir);
+        if (d != NULL) {
+            size_t base_len = strlen(base);
+            struct dirent *e;
+            while ((e = readdir(d)) != NULL) {
+                if (strcmp(e->d_name, ".") == 0 ||
+                    strcmp(e->d_name, "..") == 0) {
+                    continue;
+                }
+                // hidden files only if asked for
+                if (e->d_name[0] == '.' && base[0] != '.') {
+                    continue;
+                }
+                if (strncmp(e->d_name, base, base_len) != 0) {
+                    continue;
+                }
+                if (count >= cap) {
+                    cap *= 2;
+                    matches = realloc(matches, sizeof(char *) * cap);
+                    is_dir = realloc(is_dir, sizeof(char) * cap);
+                }
+                char *m = malloc(dir_len + strlen(e->d_name) + 1);
+                memcpy(m, word, dir_len);
+                strcpy(m + dir_len, e->d_name);
+                matches[count] = m;
+                count++;
+            }
+            closedir(d);
+        }
+        free(dir);
+
+        // sort the names so the list looks the same as ls, then flag the
+        // directories
+        qsort(matches, count, sizeof(char *), compare_strings);
+        for (int i = 0; i < count; i++) {
+            struct stat st;
+            is_dir[i] = (stat(matches[i], &st) == 0 && S_ISDIR(st.st_mode));
+        }
+    }
+
+    size_t word_len = strlen(word);
+    if (count == 0) {
+        write(1, "\a", 1); // beep
+    } else if (count == 1) {
+        append_to_line(buffer, length, capacity, matches[0] + word_len,
+                       strlen(matches[0]) - word_len);
+        append_to_line(buffer, length, capacity, is_dir[0] ? "/" : " ", 1);
+    } else {
+        // how far do all the matches agree?
+        size_t common = strlen(matches[0]);
+        for (int i = 1; i < count; i++) {
+            size_t j = 0;
+            while (j < common && matches[i][j] == matches[0][j]) {
+                j++;
+            }
+            common = j;
+        }
+
+        if (common > word_len) {
+            append_to_line(buffer, length, capacity, matches[0] + word_len,
+                           common - word_len);
+        } else {
+            // nothing more to fill in, so show the choices
+            write(1, "\n", 1);
+            int shown = (count > 200) ? 200 : count;
+            for (int i = 0; i < shown; i++) {
+                write(1, matches[i], strlen(matches[i]));
+                write(1, "  ", 2);
+            }
+            if (count > shown) {
+                printf("... and %d more", count - shown);
+                fflush(stdout);
+            }
+            write(1, "\n> ", 3);
+            write(1, *buffer, *length);
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        free(matches[i]);
+    }
+    free(matches);
+    free(is_dir);
+    free(word);
+}
+
+/*
+ * Checks if the first argument is the "memo" builtin. Unlike the other
+ * contains_ functions this only looks at the first argument, since the
+ * command being memoized can have any arguments at all.
+ */
+int contains_memo(char **argArray) {
+    if (argArray[0] != NULL && strcmp(argArray[0], "memo") == 0) {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Adds len bytes to a running 64 bit FNV-1a hash and returns the new hash.
+ * Start the hash off with memo_hash_start().
+ */
+uint64_t memo_hash(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+uint64_t memo_hash_start() {
+    return 14695981039346656037ULL;
+}
+
+/*
+ * Adds the fingerprint of a file (its name, size and modification time) to
+ * the hash. Things that aren't regular files are left out, so arguments
+ * like "-O2" add nothing here.
+ */
+uint64_t memo_hash_file(uint64_t h, const char *filename) {
+    struct stat st;
+    if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return h;
+    }
+    char fingerprint[128];
+    int n = snprintf(fingerprint, sizeof(fingerprint), "%lld:%lld.%09ld",
+                     (long long) st.st_size, (long long) st.st_mtim.tv_sec,
+                     st.st_mtim.tv_nsec);
+    h = memo_hash(h, filename, strlen(filename) + 1);
+    return memo_hash(h, fingerprint, n + 1);
+}
+
+/*
+ * Copies everything in the file in_fd to out_fd, starting at the beginning
+ * of in_fd. Uses sendfile() so the data never gets copied into the shell,
+ * and falls back to read() and write() for the odd output that sendfile()
+ * won't take.
+ */
+void memo_replay(int in_fd, int out_fd) {
+    off_t offset = 0;
+    struct stat st;
+    fstat(in_fd, &st);
+
+    while (offset < st.st_size) {
+        ssize_t sent = sendfile(out_fd, in_fd, &offset, st.st_size - offset);
+        if (sent > 0) {
+            continue;
+        }
+        if (sent == -1 && errno == EINTR) {
+            continue;
+        }
+        if (sent == -1 && (errno == EINVAL || errno == ENOSYS)) {
+            // sendfile() won't write to this, so do it the old way
+            char chunk[65536];
+            lseek(in_fd, offset, SEEK_SET);
+            ssize_t n;
+            while ((n = read(in_fd, chunk, sizeof(chunk))) > 0) {
+                write(out_fd, chunk, n);
+            }
+        }
+        break;
+    }
+}
+
+/*
+ * The "memo" builtin. argArray is the whole command line, starting with
+ * "memo". The command after "memo" (up to the first '|', if there is one)
+ * is the one that's memoized. Hashes everything its output could depend on
+ * (see rule 9 at the top of this file) and looks for the hash in the cache
+ * directory. If it's there, the command isn't run. If it isn't there, the
+ * command is run in a child with its stdout going into a new cache file.
+ * Either way the cached output then goes wherever the command's stdout was
+ * supposed to go: the terminal or a '>' file, or, when there is a '|', the
+ * stdin of the rest of the pipeline, which runs normally. Redirections were
+ * already taken out of argArray by setup_redirection() and
+ * setup_redirection_input(), so they are read from the global structs: '<'
+ * belongs to the memoized command and '>' to the last command. Records the
+ * exit status of every command (see record_status()).
+ */
+void memoCommand(char **argArray) {
+    int status = 1;
+    char **command = argArray + 1;
+
+    // a memoized command runs to completion before anything can use its
+    // output, so it can't be put in the background
+    int bad_args = (command[0] == NULL);
+    for (char **p = command; *(p) != NULL; p++) {
+        if (strcmp(*(p), "&") == 0) {
+            bad_args = 1;
+        }
+    }
+    // the first command of rest is the memoized one itself
+    char ***rest = NULL;
+    int rest_count = 0;
+    if (!bad_args && getPipe(command) != -1) {
+        rest = split_pipeline(command, &rest_count);
+        bad_args = (rest == NULL);
+    }
+    if (bad_args) {
+        argError();
+        free(rest);
+        record_status(&status, 1);
+        return;
+    }
+
+    int cached = memo_lookup_or_run(command, argArray, &status);
+    if (cached == -1) {
+        status = 1;
+        free(rest);
+        record_status(&status, 1);
+        return;
+    }
+
+    if (rest != NULL) {
+        // the rest of the pipeline reads the cached output. launch_job()
+        // closes cached, and records the status of every command after
+        // the memoized one.
+        lseek(cached, 0, SEEK_SET);
+        launch_job(rest + 1, rest_count - 1, 0, cached);
+        free(rest);
+
+        int statuses[MAX_PIPE_STATUS];
+        int count = 1;
+        statuses[0] = status;
+        for (int i = 0; i < pipe_status_count && count < MAX_PIPE_STATUS;
+             i++) {
+            statuses[count++] = pipe_status[i];
+        }
+        record_status(statuses, count);
+        return;
+    }
+
+    // send the output wherever this command's stdout was supposed to go
+    int out_fd = 1;
+    if (fr_output->index != -1) {
+        out_fd = open_output_file();
+        if (out_fd == -1) {
+            close(cached);
+            status = 1;
+            record_status(&status, 1);
+            return;
+        }
+    }
+    fflush(stdout);
+    memo_replay(cached, out_fd);
+
+    if (out_fd != 1) {
+        close(out_fd);
+    }
+    close(cached);
+    record_status(&status, 1);
+}
+
+/*
+ * Looks for the memoized result of command in the cache directory, and if
+ * it isn't there, runs command to make it. argArray is the whole line, for
+ * redirect_input(). Returns an fd of the file holding the output and sets
+ * status to the command's exit status, or returns -1 if the command
+ * couldn't be run at all.
+ *
+ * The result is only saved when the command really ran and exited. If it
+ * was killed by a signal, or it couldn't even be exec()ed (say it isn't
+ * installed yet), the output is still returned but not kept, so the next
+ * try runs it again. To tell exec() failing apart from the command
+ * exiting with 1, the child has a pipe that closes by itself when exec()
+ * works (O_CLOEXEC), and it writes errno into it when exec() fails.
+ */
+int memo_lookup_or_run(char **command, char **argArray, int *status) {
+    // find (or make) the cache directory
+    char dir[PATH_MAX];
+    if (getenv("MEMO_DIR") != NULL) {
+        snprintf(dir, sizeof(dir), "%s", getenv("MEMO_DIR"));
+    } else {
+        snprintf(dir, sizeof(dir), "%s/.myshell_memo",
+                 getenv("HOME") != NULL ? getenv("HOME") : ".");
+    }
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        perror("ERROR");
+        return -1;
+    }
+
+    // hash the arguments, working directory and environment
+    uint64_t h = memo_hash_start();
+    for (char **p = command; *(p) != NULL; p++) {
+        h = memo_hash(h, *(p), strlen(*(p)) + 1);
+    }
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        h = memo_hash(h, cwd, strlen(cwd) + 1);
+    }
+
+    char *env_list = strdup(getenv("MEMO_ENV") != NULL ?
+                            getenv("MEMO_ENV") : "PATH");
+    for (char *name = strtok(env_list, ":"); name != NULL;
+         name = strtok(NULL, ":")) {
+        char *value = getenv(name);
+        h = memo_hash(h, name, strlen(name) + 1);
+        if (value != NULL) {
+            h = memo_hash(h, value, strlen(value) + 1);
+        }
+    }
+    free(env_list);
+
+    // and the files it will read
+    for (char **p = command; *(p) != NULL; p++) {
+        h = memo_hash_file(h, *(p));
+    }
+    if (fr_input->index != -1) {
+        h = memo_hash_file(h, fr_input->filename);
+    }
+
+    // room for the directory plus the hash and an extension
+    char out_name[PATH_MAX + 32];
+    char status_name[PATH_MAX + 32];
+    snprintf(out_name, sizeof(out_name), "%s/%016llx.out", dir,
+             (unsigned long long) h);
+    snprintf(status_name, sizeof(status_name), "%s/%016llx.status", dir,
+             (unsigned long long) h);
+
+    int cached = open(out_name, O_RDONLY | O_CLOEXEC);
+    FILE *status_file = fopen(status_name, "r");
+
+    if (cached != -1 && status_file != NULL &&
+        fscanf(status_file, "%d", status) == 1) {
+        // cache hit, nothing to run
+        fclose(status_file);
+        return cached;
+    }
+    if (cached != -1) {
+        close(cached);
+    }
+    if (status_file != NULL) {
+        fclose(status_file);
+    }
+
+    // run the command with stdout going to a temp file in the cache
+    // directory. It's only renamed to its real name once it finished, so a
+    // half written output is never replayed.
+    char tmp_name[PATH_MAX + 32];
+    snprintf(tmp_name, sizeof(tmp_name), "%s/%016llx.XXXXXX", dir,
+             (unsigned long long) h);
+    cached = mkostemp(tmp_name, O_CLOEXEC);
+    if (cached == -1) {
+        perror("ERROR");
+        return -1;
+    }
+    int exec_error[2];
+    if (pipe2(exec_error, O_CLOEXEC) == -1) {
+        perror("ERROR");
+        close(cached);
+        unlink(tmp_name);
+        return -1;
+    }
+
+    refresh_path_index();
+    const char *cmd_path = lookup_command(command[0]);
+    pid_t pid = fork();
+    if (pid < 0) {
+        write(1, "Error creating process!\n", 24);
+        close(exec_error[0]);
+        close(exec_error[1]);
+        close(cached);
+        unlink(tmp_name);
+        return -1;
+    }
+    if (pid == 0) {
+        enter_job(0, 1);
+        close(exec_error[0]);
+        dup2(cached, 1);
+        if (fr_input->index != -1) {
+            redirect_input(argArray);
+        } else {
+            // the shell's own stdin (the terminal, or the rest of a script)
+            // isn't part of the hash, so the command mustn't read it
+            int null_fd = open("/dev/null", O_RDONLY);
+            dup2(null_fd, 0);
+            close(null_fd);
+        }
+        if (exec_command(command, cmd_path) == -1) {
+            int error = errno;
+            perror("ERROR");
+            write(exec_error[1], &error, sizeof(error));
+            _exit(1);
+        }
+    }
+    close(exec_error[1]);
+
+    // the command is a job of its own, like any other
+    if (shell_interactive) {
+        setpgid(pid, pid);
+    }
+    give_terminal(pid);
+    int wstatus = wait_for_stage(pid, pid);
+    take_terminal_back();
+
+    // nothing to read means exec() worked
+    int error;
+    int exec_failed = (read(exec_error[0], &error, sizeof(error)) > 0);
+    close(exec_error[0]);
+
+    *status = status_code(wstatus);
+    if (WIFEXITED(wstatus) && !exec_failed) {
+        rename(tmp_name, out_name);
+
+        // the status file is written last, since it's what tells us the
+        // entry is complete
+        char tmp_status[PATH_MAX + 64];
+        snprintf(tmp_status, sizeof(tmp_status), "%s.tmp", status_name);
+        FILE *f = fopen(tmp_status, "w");
+        if (f != NULL) {
+            fprintf(f, "%d\n", *status);
+            fclose(f);
+            rename(tmp_status, status_name);
+        }
+    } else {
+        // killed by a signal, or never ran, so the output can't be
+        // trusted. Still show what we got, but don't keep it.
+        unlink(tmp_name);
+    }
+    return cached;
+}
+
+/*
+ * Counts the open file descriptors of the shell by listing /proc/self/fd.
+ * The directory listing uses an fd of its own, which isn't counted.
+ */
+int count_open_fds() {
+    DIR *d = opendir("/proc/self/fd");
+    if (d == NULL) {
+        return -1;
+    }
+    int count = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] != '.') {
+            count++;
+        }
+    }
+    closedir(d);
+    return count - 1;
+}
+
+/*
+ * Fills in counts with the current allocation counters and number of open
+ * file descriptors.
+ */
+void diag_snapshot(struct diagCounts *counts) {
+    // count the fds first, since opendir() allocates (and frees) memory
+    counts->open_fds = count_open_fds();
+    counts->alloc_calls = __atomic_load_n(&diag_alloc_calls, __ATOMIC_RELAXED);
+    counts->live_blocks = __atomic_load_n(&diag_live_blocks, __ATOMIC_RELAXED);
+    counts->live_bytes = __atomic_load_n(&diag_live_bytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * Adds one block from malloc() to held, if there is one. Used by the
+ * functions that report what the shell's tables hold.
+ */
+void diag_add_block(struct diagCounts *held, void *p) {
+    if (p != NULL) {
+        held->live_blocks++;
+        held->live_bytes += malloc_usable_size(p);
+    }
+}
+
+/*
+ * Sets held to everything the shell keeps between commands on purpose: the
+ * $PATH index, the symbol table, the output cache, the job table and the
+ * C library's cache of thread stacks. These grow and shrink as the session
+ * goes on, so they are taken off the counts before comparing them with the
+ * baseline.
+ */
+void diag_tables_held(struct diagCounts *held) {
+    *held = thread_cache_held;
+    path_index_held(held);
+    symbols_held(held);
+    output_cache_held(held);
+    jobs_held(held);
+}
+
+/*
+ * Called by main() at the end of every loop iteration in diagnostics mode.
+ * Writes this iteration's numbers to stderr, and aborts the shell if more
+ * memory is allocated or more fds are open than at the baseline, not
+ * counting what the tables hold (see diag_tables_held()). The first
+ * iteration sets the baseline, since things like the stdin buffer are only
+ * allocated once they're first needed. The baseline never changes after
+ * that, so a leak can't hide behind a table changing size on the same line.
+ */
+void diag_check_steady_state() {
+    struct diagCounts now;
+    struct diagCounts held;
+    diag_snapshot(&now);
+    diag_tables_held(&held);
+    diag_iteration++;
+
+    fprintf(stderr, "[diag] line %lu: %lu allocations, %ld blocks (%+ld), "
+                    "%ld bytes (%+ld), %d fds (%+d), tables hold %ld blocks, "
+                    "%ld bytes, %d fds\n",
+            diag_iteration, now.alloc_calls - diag_previous.alloc_calls,
+            now.live_blocks, now.live_blocks - diag_previous.live_blocks,
+            now.live_bytes, now.live_bytes - diag_previous.live_bytes,
+            now.open_fds, now.open_fds - diag_previous.open_fds,
+            held.live_blocks, held.live_bytes, held.open_fds);
+    diag_previous = now;
+
+    now.live_blocks -= held.live_blocks;
+    now.live_bytes -= held.live_bytes;
+    now.open_fds -= held.open_fds;
+    if (!diag_have_baseline) {
+        diag_baseline = now;
+        diag_have_baseline = 1;
+    } else if (now.live_blocks > diag_baseline.live_blocks ||
+               now.live_bytes > diag_baseline.live_bytes ||
+               now.open_fds > diag_baseline.open_fds) {
+        fprintf(stderr, "[diag] steady state broken after line %lu: "
+                        "%ld blocks, %ld bytes, %d fds outside the tables, "
+                        "expected at most %ld blocks, %ld bytes, %d fds\n",
+                diag_iteration, now.live_blocks, now.live_bytes,
+                now.open_fds, diag_baseline.live_blocks,
+                diag_baseline.live_bytes, diag_baseline.open_fds);
+        abort();
+    }
+}
+
+/*
+ * Replacements for the C library's allocation functions that keep the
+ * diagnostics counters up to date, then hand the real work to the C
+ * library's allocator. glibc lets a program replace these, and then uses
+ * them for its own allocations too. A program that replaces malloc() has to
+ * replace the aligned ones (memalign() and friends) as well, or a block
+ * from one of those would be freed through our free() without ever being
+ * counted. Outside diagnostics mode nothing is counted, so a normal session
+ * pays for one extra branch per call.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *old, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void *__libc_valloc(size_t size);
+extern void *__libc_pvalloc(size_t size);
+extern void __libc_free(void *p);
+
+void diag_count_alloc(void *p) {
+    if (!diag_mode || p == NULL) {
+        return;
+    }
+    size_t size = malloc_usable_size(p);
+    __atomic_add_fetch(&diag_alloc_calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&diag_live_blocks, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&diag_live_bytes, size, __ATOMIC_RELAXED);
+    diag_thread_blocks++;
+    diag_thread_bytes += size;
+}
+
+void diag_count_free(void *p) {
+    if (!diag_mode || p == NULL) {
+        return;
+    }
+    size_t size = malloc_usable_size(p);
+    __atomic_sub_fetch(&diag_live_blocks, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&diag_live_bytes, size, __ATOMIC_RELAXED);
+    diag_thread_blocks--;
+    diag_thread_bytes -= size;
+}
+
+void *malloc(size_t size) {
+    void *p = __libc_malloc(size);
+    diag_count_alloc(p);
+    return p;
+}
+
+void *calloc(size_t count, size_t size) {
+    void *p = __libc_calloc(count, size);
+    diag_count_alloc(p);
+    return p;
+}
+
+void *realloc(void *old, size_t size) {
+    if (old == NULL) {
+        return malloc(size);
+    }
+    if (!diag_mode) {
+        return __libc_realloc(old, size);
+    }
+    size_t old_size = malloc_usable_size(old);
+    void *p = __libc_realloc(old, size);
+    if (p != NULL) {
+        long grown = (long) malloc_usable_size(p) - (long) old_size;
+        __atomic_add_fetch(&diag_alloc_calls, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&diag_live_bytes, grown, __ATOMIC_RELAXED);
+        diag_thread_bytes += grown;
+    } else if (size == 0) {
+        // realloc(p, 0) frees p
+        __atomic_sub_fetch(&diag_live_blocks, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&diag_live_bytes, old_size, __ATOMIC_RELAXED);
+        diag_thread_blocks--;
+        diag_thread_bytes -= old_size;
+    }
+    return p;
+}
+
+void *memalign(size_t alignment, size_t size) {
+    void *p = __libc_memalign(alignment, size);
+    diag_count_alloc(p);
+    return p;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **result, size_t alignment, size_t size) {
+    // the alignment has to be a power of 2 and a multiple of sizeof(void *)
+    if (alignment % sizeof(void *) != 0 ||
+        (alignment & (alignment - 1)) != 0 || alignment == 0) {
+        return EINVAL;
+    }
+    void *p = memalign(alignment, size);
+    if (p == NULL) {
+        return ENOMEM;
+    }
+    *result = p;
+    return 0;
+}
+
+void *valloc(size_t size) {
+    void *p = __libc_valloc(size);
+    diag_count_alloc(p);
+    return p;
+}
+
+void *pvalloc(size_t size) {
+    void *p = __libc_pvalloc(size);
+    diag_count_alloc(p);
+    return p;
+}
+
+void free(void *p) {
+    diag_count_free(p);
+    __libc_free(p);
+}
+
+/*
+ * Returns the hash of a symbol name. The in-memory table and the snapshot
+ * both use this, so it must never change without bumping SNAPSHOT_VERSION.
+ */
+uint32_t symbol_hash(const char *name) {
+    return (uint32_t) memo_hash(memo_hash_start(), name, strlen(name));
+}
+
+/*
+ * Joins the strings in args into one string with single spaces between
+ * them. The caller frees the new string.
+ */
+char *join_args(char **args) {
+    size_t length = 1;
+    for (char **p = args; *(p) != NULL; p++) {
+        length += strlen(*(p)) + 1;
+    }
+    char *joined = malloc(length);
+    joined[0] = '\0';
+    for (char **p = args; *(p) != NULL; p++) {
+        if (p != args) {
+            strcat(joined, " ");
+        }
+        strcat(joined, *(p));
+    }
+    return joined;
+}
+
+/*
+ * Checks if the first argument is "alias" or "function", the two builtins
+ * that define symbols.
+ */
+int contains_definition(char **argArray) {
+    if (strcmp(argArray[0], "alias") == 0 ||
+        strcmp(argArray[0], "function") == 0) {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Returns the record at offset in the mmap()ed rc snapshot, or NULL if it
+ * doesn't fit in the file, or its name or value isn't terminated with a
+ * '\0' where its lengths say. Checking both terminators means the strings
+ * can be handed to strcmp() and printf() without reading past the end of
+ * the mapping.
+ */
+const struct snapshotRecord *snapshot_record(uint64_t offset) {
+    if (offset + sizeof(struct snapshotRecord) > snapshot_size) {
+        return NULL;
+    }
+    const struct snapshotRecord *record = (const void *)
+            (snapshot_map + offset);
+    if (offset + sizeof(*record) + (uint64_t) record->name_len +
+        record->value_len + 2 > snapshot_size) {
+        return NULL;
+    }
+    const char *name = (const char *) (record + 1);
+    if (name[record->name_len] != '\0' ||
+        name[record->name_len + 1 + (uint64_t) record->value_len] != '\0') {
+        return NULL;
+    }
+    return record;
+}
+
+/*
+ * Looks a name up in the mmap()ed rc snapshot. Every record is checked with
+ * snapshot_record() before it's used, so a corrupt snapshot just means the
+ * name isn't found. The returned symbol points into the snapshot and is
+ * overwritten by the next call, so copy anything you need to keep.
+ */
+struct symbol *lookup_snapshot(const char *name) {
+    static struct symbol found;
+
+    if (snapshot_map == NULL) {
+        return NULL;
+    }
+    const struct snapshotHeader *header = (const void *) snapshot_map;
+    const uint32_t *buckets = (const void *) (snapshot_map + sizeof(*header));
+
+    uint32_t offset = buckets[symbol_hash(name) & (header->bucket_count - 1)];
+    while (offset != 0) {
+        const struct snapshotRecord *record = snapshot_record(offset);
+        if (record == NULL) {
+            return NULL;
+        }
+        const char *record_name = (const char *) (record + 1);
+
+        if (strcmp(record_name, name) == 0) {
+            found.name = (char *) record_name;
+            found.value = (char *) record_name + record->name_len + 1;
+            found.kind = record->kind;
+            found.next = NULL;
+            return &found;
+        }
+        // chains only go backwards, so even a corrupt file can't loop
+        if (record->next >= offset) {
+            return NULL;
+        }
+        offset = record->next;
+    }
+    return NULL;
+}
+
+/*
+ * Looks a name up in the symbol table, and then in the rc snapshot.
+ * Returns NULL if it isn't an alias or function. An alias whose expansion
+ * is in progress isn't returned, so "alias ls=ls -l" works.
+ */
+struct symbol *lookup_symbol(const char *name) {
+    struct symbol *sym = symbol_table[symbol_hash(name) & (SYMBOL_BUCKETS - 1)];
+    while (sym != NULL && strcmp(sym->name, name) != 0) {
+        sym = sym->next;
+    }
+    if (sym == NULL) {
+        sym = lookup_snapshot(name);
+    }
+
+    if (sym != NULL && sym->kind == SYMBOL_ALIAS &&
+        expanding_alias != NULL && strcmp(expanding_alias, name) == 0) {
+        return NULL;
+    }
+    return sym;
+}
+
+/*
+ * Adds a symbol to the symbol table, or replaces the one with the same name.
+ */
+void set_symbol(const char *name, const char *value, int kind) {
+    uint32_t bucket = symbol_hash(name) & (SYMBOL_BUCKETS - 1);
+    struct symbol *sym = symbol_table[bucket];
+    while (sym != NULL && strcmp(sym->name, name) != 0) {
+        sym = sym->next;
+    }
+
+    if (sym == NULL) {
+        sym = malloc(sizeof(*sym));
+        sym->name = strdup(name);
+        sym->next = symbol_table[bucket];
+        symbol_table[bucket] = sym;
+    } else {
+        free(sym->value);
+    }
+    sym->value = strdup(value);
+    sym->kind = kind;
+}
+
+/*
+ * Adds the memory held by the symbol table to held, for diagnostics mode.
+ */
+void symbols_held(struct diagCounts *held) {
+    for (int i = 0; i < SYMBOL_BUCKETS; i++) {
+        for (struct symbol *sym = symbol_table[i]; sym != NULL;
+             sym = sym->next) {
+            diag_add_block(held, sym);
+            diag_add_block(held, sym->name);
+            diag_add_block(held, sym->value);
+        }
+    }
+}
+
+/*
+ * Prints one symbol the way it would be defined.
+ */
+void print_symbol(const char *name, const char *value, int kind) {
+    if (kind == SYMBOL_ALIAS) {
+        printf("alias %s=%s\n", name, value);
+    } else {
+        printf("function %s %s\n", name, value);
+    }
+}
+
+/*
+ * Prints every symbol of the given kind, from the symbol table and from the
+ * snapshot (unless the symbol table has the same name).
+ */
+void list_symbols(int kind) {
+    for (int i = 0; i < SYMBOL_BUCKETS; i++) {
+        for (struct symbol *sym = symbol_table[i]; sym != NULL;
+             sym = sym->next) {
+            if (sym->kind == kind) {
+                print_symbol(sym->name, sym->value, kind);
+            }
+        }
+    }
+
+    if (snapshot_map != NULL) {
+        const struct snapshotHeader *header = (const void *) snapshot_map;
+        size_t offset = sizeof(*header) +
+                        sizeof(uint32_t) * header->bucket_count;
+
+        // the records are packed one after the other
+        while (offset + sizeof(struct snapshotRecord) <= snapshot_size) {
+            const struct snapshotRecord *record = snapshot_record(offset);
+            if (record == NULL) {
+                break;
+            }
+            size_t length = sizeof(*record) + (size_t) record->name_len +
+                            record->value_len + 2;
+            const char *name = (const char *) (record + 1);
+            if (record->kind == (uint32_t) kind &&
+                lookup_symbol(name) == lookup_snapshot(name)) {
+                print_symbol(name, name + record->name_len + 1, kind);
+            }
+            offset += (length + 3) & ~(size_t) 3;
+        }
+    }
+    fflush(stdout);
+}
+
+/*
+ * The "alias" and "function" builtins. argArray is the tokenized line.
+ *   alias                 lists the aliases
+ *   alias name=text...    defines an alias
+ *   function              lists the functions
+ *   function name body... defines a function
+ */
+void defineSymbol(char **argArray) {
+    int kind = (strcmp(argArray[0], "alias") == 0) ?
+               SYMBOL_ALIAS : SYMBOL_FUNCTION;
+
+    if (argArray[1] == NULL) {
+        list_symbols(kind);
+        return;
+    }
+
+    if (kind == SYMBOL_ALIAS) {
+        char *equals = strchr(argArray[1], '=');
+        if (equals == NULL || equals == argArray[1]) {
+            argError();
+            return;
+        }
+        // "ll=ls" "-l" becomes the name "ll" and the text "ls -l"
+        char *name = argArray[1];
+        *equals = '\0';
+        argArray[1] = equals + 1;
+        char *value = join_args(argArray + 1);
+        set_symbol(name, value, kind);
+        free(value);
+    } else {
+        if (argArray[2] == NULL) {
+            argError();
+            return;
+        }
+        char *body = join_args(argArray + 2);
+        set_symbol(argArray[1], body, kind);
+        free(body);
+    }
+}
+
+/*
+ * Runs an alias. The alias text replaces the first argument, and the new
+ * line is run like any other (so it can have pipes, redirection, etc).
+ */
+void runAlias(struct symbol *sym, char **argArray, int depth) {
+    // the symbol may live in lookup_snapshot()'s static storage, so grab
+    // what we need before running anything
+    char *name = strdup(sym->name);
+    char *rest = join_args(argArray + 1);
+    char *line = malloc(strlen(sym->value) + strlen(rest) + 2);
+    sprintf(line, "%s%s%s", sym->value, rest[0] != '\0' ? " " : "", rest);
+
+    const char *outer = expanding_alias;
+    expanding_alias = name;
+    executeLine(line, depth + 1);
+    expanding_alias = outer;
+
+    free(line);
+    free(rest);
+    free(name);
+}
+
+/*
+ * Runs a function. $0-$9 and $@ in the body are replaced with the function
+ * name and arguments, and then each " ; " separated command in the body is
+ * run in order.
+ */
+void runFunction(struct symbol *sym, char **argArray, int depth) {
+    int argc = 0;
+    while (argArray[argc] != NULL) {
+        argc++;
+    }
+    char *all_args = join_args(argArray + 1);
+
+    // first work out how long the expanded body will be
+    size_t length = 1;
+    for (const char *p = sym->value; *p != '\0'; p++) {
+        if (p[0] == '$' && p[1] >= '0' && p[1] <= '9') {
+            int n = p[1] - '0';
+            length += (n < argc) ? strlen(argArray[n]) : 0;
+            p++;
+        } else if (p[0] == '$' && p[1] == '@') {
+            length += strlen(all_args);
+            p++;
+        } else {
+            length++;
+        }
+    }
+
+    char *body = malloc(length);
+    char *out = body;
+    for (const char *p = sym->value; *p != '\0'; p++) {
+        if (p[0] == '$' && p[1] >= '0' && p[1] <= '9') {
+            int n = p[1] - '0';
+            if (n < argc) {
+                strcpy(out, argArray[n]);
+                out += strlen(argArray[n]);
+            }
+            p++;
+        } else if (p[0] == '$' && p[1] == '@') {
+            strcpy(out, all_args);
+            out += strlen(all_args);
+            p++;
+        } else {
+            *(out++) = *p;
+        }
+    }
+    *out = '\0';
+    free(all_args);
+
+    // run each command. A ";" only counts as a separator when it's a word
+    // by itself.
+    char *command = body;
+    while (command != NULL) {
+        char *next = NULL;
+        for (char *q = command; *q != '\0'; q++) {
+            if (*q == ';' && (q == body || q[-1] == ' ') &&
+                (q[1] == ' ' || q[1] == '\0')) {
+                *q = '\0';
+                next = q + 1;
+                break;
+            }
+        }
+
+        // trim the spaces around the command, argCounter() counts them
+        while (*command == ' ') {
+            command++;
+        }
+        size_t end = strlen(command);
+        while (end > 0 && command[end - 1] == ' ') {
+            command[--end] = '\0';
+        }
+
+        executeLine(command, depth + 1);
+        command = next;
+    }
+
+    free(body);
+}
+
+/*
+ * Tries to mmap() the rc snapshot at snap_path. Returns 1 and sets
+ * snapshot_map if the snapshot is there, is the right version, and was
+ * made from the rc file described by rc. Returns 0 otherwise.
+ */
+int map_snapshot(const char *snap_path, struct stat *rc) {
+    int fd = open(snap_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        (size_t) st.st_size < sizeof(struct snapshotHeader)) {
+        close(fd);
+        return 0;
+    }
+
+    // the mapping stays valid after the fd is closed
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+
+    const struct snapshotHeader *header = map;
+    uint32_t buckets = header->bucket_count;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, 8) != 0 ||
+        header->version != SNAPSHOT_VERSION ||
+        header->file_size != (uint64_t) st.st_size ||
+        buckets == 0 || (buckets & (buckets - 1)) != 0 ||
+        sizeof(*header) + sizeof(uint32_t) * (uint64_t) buckets >
+        (uint64_t) st.st_size ||
+        header->rc_size != (uint64_t) rc->st_size ||
+        header->rc_ino != (uint64_t) rc->st_ino ||
+        header->rc_dev != (uint64_t) rc->st_dev ||
+        header->rc_mtime_sec != (int64_t) rc->st_mtim.tv_sec ||
+        header->rc_mtime_nsec != (int64_t) rc->st_mtim.tv_nsec) {
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    snapshot_map = map;
+    snapshot_size = st.st_size;
+    return 1;
+}
+
+/*
+ * Writes everything in the symbol table to a new snapshot at snap_path,
+ * stamped with the identity of the rc file described by rc. The snapshot is
+ * written to a temp file and renamed into place, so another shell starting
+ * at the same time never sees half of it.
+ */
+void write_snapshot(const char *snap_path, struct stat *rc) {
+    int count = 0;
+    size_t records_size = 0;
+    for (int i = 0; i < SYMBOL_BUCKETS; i++) {
+        for (struct symbol *sym = symbol_table[i]; sym != NULL;
+             sym = sym->next) {
+            count++;
+            records_size += (sizeof(struct snapshotRecord) +
+                             strlen(sym->name) + strlen(sym->value) + 2 + 3) &
+                            ~(size_t) 3;
+        }
+    }
+
+    // keep the chains short: at least twice as many buckets as symbols
+    uint32_t bucket_count = 16;
+    while (bucket_count < (uint32_t) count * 2) {
+        bucket_count *= 2;
+    }
+
+    size_t records_start = sizeof(struct snapshotHeader) +
+                           sizeof(uint32_t) * bucket_count;
+    size_t file_size = records_start + records_size;
+    char *image = calloc(1, file_size);
+
+    struct snapshotHeader *header = (void *) image;
+    memcpy(header->magic, SNAPSHOT_MAGIC, 8);
+    header->version = SNAPSHOT_VERSION;
+    header->bucket_count = bucket_count;
+    header->file_size = file_size;
+    header->rc_size = rc->st_size;
+    header->rc_ino = rc->st_ino;
+    header->rc_dev = rc->st_dev;
+    header->rc_mtime_sec = rc->st_mtim.tv_sec;
+    header->rc_mtime_nsec = rc->st_mtim.tv_nsec;
+
+    uint32_t *buckets = (void *) (image + sizeof(*header));
+    size_t offset = records_start;
+    for (int i = 0; i < SYMBOL_BUCKETS; i++) {
+        for (struct symbol *sym = symbol_table[i]; sym != NULL;
+             sym = sym->next) {
+            struct snapshotRecord *record = (void *) (image + offset);
+            uint32_t bucket = symbol_hash(sym->name) & (bucket_count - 1);
+            record->kind = sym->kind;
+            record->name_len = strlen(sym->name);
+            record->value_len = strlen(sym->value);
+            // push onto the front of the bucket's chain. The old front was
+            // written earlier, so its offset is smaller.
+            record->next = buckets[bucket];
+            buckets[bucket] = offset;
+
+            char *name = (char *) (record + 1);
+            strcpy(name, sym->name);
+            strcpy(name + record->name_len + 1, sym->value);
+            offset += (sizeof(*record) + record->name_len +
+                       record->value_len + 2 + 3) & ~(size_t) 3;
+        }
+    }
+
+    char tmp_path[PATH_MAX + 32];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", snap_path);
+    int fd = mkstemp(tmp_path);
+    if (fd != -1) {
+        if (write(fd, image, file_size) == (ssize_t) file_size) {
+            rename(tmp_path, snap_path);
+        } else {
+            unlink(tmp_path);
+        }
+        close(fd);
+    }
+    free(image);
+}
+
+/*
+ * Loads the user's rc file (see rule 12 at the top of the file). If the
+ * snapshot is up to date it's just mmap()ed, which takes the same time no
+ * matter how big the rc file is. Otherwise the rc file is parsed into the
+ * symbol table and a new snapshot is written for next time.
+ */
+void load_rc() {
+    char rc_path[PATH_MAX];
+    if (getenv("MYSHELL_RC") != NULL) {
+        snprintf(rc_path, sizeof(rc_path), "%s", getenv("MYSHELL_RC"));
+    } else {
+        snprintf(rc_path, sizeof(rc_path), "%s/.myshellrc",
+                 getenv("HOME") != NULL ? getenv("HOME") : ".");
+    }
+
+    struct stat rc;
+    if (stat(rc_path, &rc) != 0) {
+        return;
+    }
+
+    char snap_path[PATH_MAX + 8];
+    snprintf(snap_path, sizeof(snap_path), "%s.snap", rc_path);
+    if (map_snapshot(snap_path, &rc) == 1) {
+        return;
+    }
+
+    FILE *f = fopen(rc_path, "r");
+    if (f == NULL) {
+        return;
+    }
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &line_capacity, f)) != -1) {
+        if (length > 0 && line[length - 1] == '\n') {
+            line[--length] = '\0';
+        }
+        if (length == 0 || line[0] == '#') {
+            continue;
+        }
+
+        numArgs = argCounter(line);
+        char **argArray = tokenize(line, numArgs);
+        if (argArray[0] != NULL && contains_definition(argArray) == 1 &&
+            argArray[1] != NULL) {
+            defineSymbol(argArray);
+        } else if (argArray[0] != NULL) {
+            fprintf(stderr, "%s: skipping line, only alias and function "
+                            "definitions are allowed\n", rc_path);
+        }
+        free(argArray);
+    }
+    free(line);
+    fclose(f);
+
+    write_snapshot(snap_path, &rc);
+}
+
+/*
+ * Signal handler for SIGINT, SIGQUIT, SIGTERM and SIGHUP sent to the shell.
+ * While a foreground job is running, the signal is passed on to the job
+ * (see signal_job()), and the shell keeps going. With no job running,
+ * SIGTERM and SIGHUP kill the shell like they normally would, and SIGINT and
+ * SIGQUIT are ignored. SIGHUP is both passed on and kills the shell, since
+ * the terminal is gone.
+ */
+void forward_signal(int sig) {
+    if (foreground_pgid > 0) {
+        signal_job(foreground_pgid, sig);
+    }
+    if (sig == SIGHUP || (sig == SIGTERM && foreground_pgid == 0)) {
+        signal(sig, SIG_DFL);
+        raise(sig);
+    }
+}
+
+/*
+ * Called once at startup. If stdin is a terminal, waits until the shell is
+ * in the foreground, puts the shell in its own process group, and takes the
+ * terminal. The job control signals are ignored so the shell can't be
+ * stopped when it hands the terminal around. Either way, installs
+ * forward_signal() for the signals that should go to the foreground job.
+ */
+void init_job_control() {
+    shell_interactive = isatty(0);
+
+    if (shell_interactive) {
+        // if we were started in the background, wait to be brought forward
+        while (tcgetpgrp(0) != getpgrp()) {
+            kill(-getpgrp(), SIGTTIN);
+        }
+
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
+
+        // fails if we're a session leader already, which is fine
+        setpgid(0, 0);
+        tcsetpgrp(0, getpgrp());
+    }
+    shell_pgid = getpgrp();
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = forward_signal;
+    sigemptyset(&action.sa_mask);
+    // restart read() and waitpid() instead of failing with EINTR
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGQUIT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGHUP, &action, NULL);
+}
+
+/*
+ * Called by a newly forked child before it execs. If the shell is
+ * interactive, joins the job's process group (pgid 0 makes the child the
+ * leader of a new group) and takes the terminal if this is a foreground
+ * job. A job of a non-interactive shell stays in the shell's group, since
+ * a group that isn't the terminal's foreground group gets stopped by
+ * SIGTTIN as soon as it reads the terminal. Either way, puts back the
+ * default signal handling the shell changed.
+ */
+void enter_job(pid_t pgid, int foreground) {
+    if (shell_interactive) {
+        setpgid(0, pgid);
+        if (foreground) {
+            tcsetpgrp(0, getpgrp());
+        }
+    }
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGHUP, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+}
+
+/*
+ * Makes pgid the foreground job: signals to the shell get forwarded to it,
+ * and it gets the terminal.
+ */
+void give_terminal(pid_t pgid) {
+    foreground_pgid = pgid;
+    if (shell_interactive) {
+        tcsetpgrp(0, pgid);
+    }
+}
+
+/*
+ * Sends sig to a job: its whole process group if the shell is interactive.
+ * Otherwise the job has no group of its own, and pgid is the pid of its
+ * first stage, so that's who gets it (the later stages then see the end of
+ * their input). Only uses kill(), so it's safe in a signal handler.
+ */
+void signal_job(pid_t pgid, int sig) {
+    kill(shell_interactive ? -pgid : pgid, sig);
+}
+
+/*
+ * Called once the foreground job is done. Gives the terminal back to the
+ * shell.
+ */
+void take_terminal_back() {
+    foreground_pgid = 0;
+    if (shell_interactive) {
+        tcsetpgrp(0, shell_pgid);
+    }
+}
+
+/*
+ * Waits for one stage of a job to finish and returns its wait status. If
+ * the stage gets stopped (Ctrl-Z), the whole group is continued, since
+ * there's no way to bring a stopped job back. A stage stopped by SIGTTIN or
+ * SIGTTOU wanted a terminal it doesn't have, and continuing it would just
+ * stop it again right away, so then we stop watching for stops and wait
+ * for someone else to continue or kill it.
+ */
+int wait_for_stage(pid_t pid, pid_t pgid) {
+    int wstatus = 0;
+    int options = WUNTRACED;
+    while (1) {
+        pid_t r = waitpid(pid, &wstatus, options);
+        if (r == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // not our child anymore, count it as a failure
+            return 1 << 8;
+        }
+        if (WIFSTOPPED(wstatus)) {
+            if (WSTOPSIG(wstatus) == SIGTTIN || WSTOPSIG(wstatus) == SIGTTOU) {
+                options = 0;
+            } else {
+                signal_job(pgid, SIGCONT);
+            }
+            continue;
+        }
+        return wstatus;
+    }
+}
+
+/*
+ * Turns a wait status into an exit status the way other shells do: the exit
+ * code of a process that exited, or 128 + the signal number of a process
+ * that was killed.
+ */
+int status_code(int wstatus) {
+    if (WIFEXITED(wstatus)) {
+        return WEXITSTATUS(wstatus);
+    }
+    if (WIFSIGNALED(wstatus)) {
+        return 128 + WTERMSIG(wstatus);
+    }
+    return 1;
+}
+
+/*
+ * Remembers the exit status of every stage of the job that just finished,
+ * for $PIPESTATUS, and works out the status of the whole job for $?. That's
+ * the status of the last stage, unless pipefail is on, in which case it's
+ * the status of the last stage that failed.
+ */
+void record_status(int *statuses, int count) {
+    pipe_status_count = (count > MAX_PIPE_STATUS) ? MAX_PIPE_STATUS : count;
+    memcpy(pipe_status, statuses, sizeof(int) * pipe_status_count);
+
+    last_status = statuses[count - 1];
+    if (pipefail) {
+        last_status = 0;
+        for (int i = count - 1; i >= 0; i--) {
+            if (statuses[i] != 0) {
+                last_status = statuses[i];
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * Replaces every "$?" argument with the last exit status, and every
+ * "$PIPESTATUS" argument with the status of each stage of the last job,
+ * separated by spaces. The text lives in static buffers, which is fine
+ * since a line is done with it before the next line is expanded.
+ */
+void expand_status(char **argArray) {
+    static char status_text[16];
+    static char pipe_status_text[MAX_PIPE_STATUS * 12];
+
+    for (char **p = argArray; *(p) != NULL; p++) {
+        if (strcmp(*(p), "$?") == 0) {
+            snprintf(status_text, sizeof(status_text), "%d", last_status);
+            *(p) = status_text;
+        } else if (strcmp(*(p), "$PIPESTATUS") == 0) {
+            int length = 0;
+            pipe_status_text[0] = '\0';
+            for (int i = 0; i < pipe_status_count; i++) {
+                length += snprintf(pipe_status_text + length,
+                                   sizeof(pipe_status_text) - length,
+                                   (i == 0) ? "%d" : " %d", pipe_status[i]);
+            }
+            *(p) = pipe_status_text;
+        }
+    }
+}
+
+/*
+ * Checks if the first argument is the "set" builtin.
+ */
+int contains_set(char **argArray) {
+    if (argArray[0] != NULL && strcmp(argArray[0], "set") == 0) {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * The "set" builtin. "set -o name" turns an option on, "set +o name" turns
+ * it off, and "set" by itself lists every option. Returns 0, or 1 if the
+ * arguments were wrong.
+ */
+int setCommand(char **argArray) {
+    if (argArray[1] == NULL) {
+        for (struct shellOption *o = shell_options; o->name != NULL; o++) {
+            printf("set %co %s\n", *(o->flag) ? '-' : '+', o->name);
+        }
+        fflush(stdout);
+        return 0;
+    }
+
+    if (argArray[2] == NULL ||
+        (strcmp(argArray[1], "-o") != 0 && strcmp(argArray[1], "+o") != 0)) {
+        argError();
+        return 1;
+    }
+
+    for (struct shellOption *o = shell_options; o->name != NULL; o++) {
+        if (strcmp(o->name, argArray[2]) == 0) {
+            *(o->flag) = (argArray[1][0] == '-');
+            return 0;
+        }
+    }
+    write(1, "Unknown option!\n", 16);
+    return 1;
+}
+
+/*
+ * Checks if a pipeline stage is one the shell can run itself (see rule 14),
+ * and if so fills in stage with what it should do. Returns 1 if the shell
+ * can run it, 0 if the real program has to be used.
+ */
+int parse_builtin_stage(char **argArray, struct builtinStage *stage) {
+    memset(stage, 0, sizeof(*stage));
+
+    if (strcmp(argArray[0], "grep") == 0) {
+        int i = 1;
+        for (; argArray[i] != NULL && argArray[i][0] == '-' &&
+               argArray[i][1] != '\0'; i++) {
+            for (char *f = argArray[i] + 1; *f != '\0'; f++) {
+                if (*f == 'v') {
+                    stage->invert = 1;
+                } else if (*f == 'c') {
+                    stage->count_only = 1;
+                } else {
+                    return 0;
+                }
+            }
+        }
+        // exactly one pattern, and no files
+        if (argArray[i] == NULL || argArray[i + 1] != NULL) {
+            return 0;
+        }
+        // only plain strings, real grep does regular expressions
+        if (strpbrk(argArray[i], ".[]*^$\\") != NULL) {
+            return 0;
+        }
+        stage->kind = STAGE_GREP;
+        stage->pattern = argArray[i];
+        stage->pattern_len = strlen(argArray[i]);
+        return 1;
+    }
+
+    if (strcmp(argArray[0], "wc") == 0) {
+        if (argArray[1] == NULL || argArray[2] != NULL ||
+            (strcmp(argArray[1], "-l") != 0 &&
+             strcmp(argArray[1], "-c") != 0)) {
+            return 0;
+        }
+        stage->kind = STAGE_WC;
+        stage->wc_mode = argArray[1][1];
+        return 1;
+    }
+
+    if (strcmp(argArray[0], "head") == 0) {
+        const char *number = "10";
+        if (argArray[1] != NULL) {
+            if (strcmp(argArray[1], "-n") == 0 && argArray[2] != NULL &&
+                argArray[3] == NULL) {
+                number = argArray[2];
+            } else if (strncmp(argArray[1], "-n", 2) == 0 &&
+                       argArray[1][2] != '\0' && argArray[2] == NULL) {
+                number = argArray[1] + 2;
+            } else if (argArray[1][0] == '-' && argArray[2] == NULL) {
+                number = argArray[1] + 1;
+            } else {
+                return 0;
+            }
+        }
+        char *end;
+        long limit = strtol(number, &end, 10);
+        if (*number == '\0' || *end != '\0' || limit < 0) {
+            return 0;
+        }
+        stage->kind = STAGE_HEAD;
+        stage->limit = limit;
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Opens where the last stage of a pipeline writes when that stage is run by
+ * the shell: the redirected output file if there is one, or else a copy of
+ * the shell's stdout (a copy, so the stage can close it when it's done).
+ * Returns the fd, or -1 if the file couldn't be opened.
+ */
+int open_stage_output() {
+    if (fr_output->index != -1) {
+        return open_output_file();
+    }
+    // anything printf()ed has to come out before the stage's output
+    fflush(stdout);
+    return fcntl(1, F_DUPFD_CLOEXEC, 0);
+}
+
+/*
+ * Writes out everything a builtin stage has waiting in its output buffer.
+ */
+void stage_flush(struct builtinStage *stage) {
+    size_t done = 0;
+    while (done < stage->out_length && !stage->broken) {
+        ssize_t n = write(stage->out_fd, stage->out + done,
+                          stage->out_length - done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // EPIPE: whoever was reading is gone
+            stage->broken = 1;
+            break;
+        }
+        done += n;
+    }
+    stage->out_length = 0;
+}
+
+/*
+ * Adds len bytes to a builtin stage's output, flushing first if they don't
+ * fit.
+ */
+void stage_emit(struct builtinStage *stage, const char *data, size_t len) {
+    if (stage->out_length + len > STAGE_BUFFER_SIZE) {
+        stage_flush(stage);
+    }
+    if (len > STAGE_BUFFER_SIZE) {
+        // too big to buffer, write it straight out
+        char *saved = stage->out;
+        stage->out = (char *) data;
+        stage->out_length = len;
+        stage_flush(stage);
+        stage->out = saved;
+        return;
+    }
+    memcpy(stage->out + stage->out_length, data, len);
+    stage->out_length += len;
+}
+
+/*
+ * Runs grep on a chunk of complete lines (the last one may be missing its
+ * '\n' if it's the end of the input). Uses memmem() to jump straight to the
+ * next match and only then looks for the edges of the line it's in, so the
+ * lines in between are never looked at one by one. glibc's memchr() and
+ * memmem() use SIMD instructions, so this goes through memory about as fast
+ * as it can be read.
+ */
+void grep_chunk(struct builtinStage *stage, const char *chunk, size_t len) {
+    const char *end = chunk + len;
+    const char *pos = chunk;
+
+    if (!stage->invert) {
+        while (pos < end) {
+            const char *match = memmem(pos, end - pos, stage->pattern,
+                                       stage->pattern_len);
+            if (match == NULL) {
+                break;
+            }
+            // pos is always at the start of a line
+            const char *line = memrchr(pos, '\n', match - pos);
+            line = (line == NULL) ? pos : line + 1;
+            const char *newline = memchr(match, '\n', end - match);
+            const char *next = (newline == NULL) ? end : newline + 1;
+
+            stage->count++;
+            if (!stage->count_only) {
+                stage_emit(stage, line, next - line);
+                if (newline == NULL) {
+                    stage_emit(stage, "\n", 1);
+                }
+            }
+            pos = next;
+        }
+        return;
+    }
+
+    // -v has to look at every line
+    while (pos < end) {
+        const char *newline = memchr(pos, '\n', end - pos);
+        const char *next = (newline == NULL) ? end : newline + 1;
+        const char *line_end = (newline == NULL) ? end : newline;
+        if (memmem(pos, line_end - pos, stage->pattern,
+                   stage->pattern_len) == NULL) {
+            stage->count++;
+            if (!stage->count_only) {
+                stage_emit(stage, pos, next - pos);
+                if (newline == NULL) {
+                    stage_emit(stage, "\n", 1);
+                }
+            }
+        }
+        pos = next;
+    }
+}
+
+/*
+ * Runs head on a chunk of input. The chunk doesn't have to end at the end
+ * of a line: a line only counts once its '\n' goes through, so a partial
+ * line is just passed on and the rest of it comes with the next chunk.
+ * Returns 1 once enough lines have gone through, 0 if it wants more.
+ */
+int head_chunk(struct builtinStage *stage, const char *chunk, size_t len) {
+    const char *end = chunk + len;
+    const char *pos = chunk;
+    while (pos < end && stage->count < stage->limit) {
+        const char *newline = memchr(pos, '\n', end - pos);
+        if (newline == NULL) {
+            pos = end;
+            break;
+        }
+        pos = newline + 1;
+        stage->count++;
+    }
+    stage_emit(stage, chunk, pos - chunk);
+    return stage->count >= stage->limit;
+}
+
+/*
+ * The thread that runs a builtin pipeline stage. Reads the input in big
+ * chunks and hands each one to the stage. wc and head only care about the
+ * '\n's, so they take every chunk as it is. grep needs whole lines, so it
+ * gets the complete lines in each chunk, and any partial line is carried
+ * over to the next read (up to STAGE_MAX_LINE). When the stage is done,
+ * both fds are closed, which is what tells the next stage there's no more
+ * input. head closes its input as soon as it has its lines, so the process
+ * writing to it gets SIGPIPE.
+ */
+void *run_builtin_stage(void *arg) {
+    struct builtinStage *stage = arg;
+
+    // a write to a pipe nobody reads would send SIGPIPE and kill the whole
+    // shell. Blocked, the write just fails with EPIPE instead.
+    sigset_t block;
+    sigemptyset(&block);
+    sigaddset(&block, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &block, NULL);
+
+    size_t capacity = STAGE_BUFFER_SIZE;
+    char *buffer = malloc(capacity);
+    stage->out = malloc(STAGE_BUFFER_SIZE);
+    size_t have = 0;
+    int eof = (stage->kind == STAGE_HEAD && stage->limit == 0);
+    int done = eof;
+
+    while (!done && !stage->broken) {
+        ssize_t n = read(stage->in_fd, buffer + have, capacity - have);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            eof = 1;
+            n = 0;
+        }
+        // the bytes this read added
+        const char *fresh = buffer + have;
+        have += n;
+
+        if (stage->kind == STAGE_WC) {
+            if (stage->wc_mode == 'c') {
+                stage->count += n;
+            } else {
+                for (const char *p = fresh; (p = memchr(p, '\n',
+                     fresh + n - p)) != NULL; p++) {
+                    stage->count++;
+                }
+            }
+            have = 0;
+        } else if (stage->kind == STAGE_HEAD) {
+            done = head_chunk(stage, buffer, have);
+            have = 0;
+        } else {
+            // everything up to the last '\n' is complete lines. What was
+            // carried over has no '\n' in it, so only the new bytes need
+            // looking at. At the end of the input, whatever is left is a
+            // last line with no '\n'.
+            size_t complete = have;
+            if (!eof) {
+                const char *last = memrchr(fresh, '\n', n);
+                complete = (last == NULL) ? 0 : (last - buffer) + 1;
+            }
+            if (complete > 0) {
+                grep_chunk(stage, buffer, complete);
+                if (complete < have) {
+                    memmove(buffer, buffer + complete, have - complete);
+                }
+                have -= complete;
+            }
+            // a line longer than the whole buffer, make room. Cutting the
+            // line up would give different matches than the real grep, so
+            // one that's too long is an error.
+            if (have == capacity) {
+                char *bigger = NULL;
+                if (capacity < STAGE_MAX_LINE) {
+                    bigger = realloc(buffer, capacity * 2);
+                }
+                if (bigger == NULL) {
+                    write(2, "grep: line too long\n", 20);
+                    stage->failed = 1;
+                    break;
+                }
+                buffer = bigger;
+                capacity *= 2;
+            }
+        }
+        // send on what we have, so a slow producer's output still shows up
+        // as it comes
+        stage_flush(stage);
+
+        if (eof) {
+            break;
+        }
+    }
+
+    // close the input first. For head that's usually before the input ran
+    // out, and this is how the writer finds out.
+    close(stage->in_fd);
+
+    if (!stage->failed && (stage->kind == STAGE_WC || stage->count_only)) {
+        char text[32];
+        int length = snprintf(text, sizeof(text), "%ld\n", stage->count);
+        stage_emit(stage, text, length);
+        stage_flush(stage);
+    }
+    close(stage->out_fd);
+
+    if (stage->failed) {
+        stage->status = 2;
+    } else if (stage->kind == STAGE_GREP) {
+        stage->status = (stage->count > 0) ? 0 : 1;
+    } else {
+        stage->status = 0;
+    }
+    free(stage->out);
+    free(buffer);
+    return NULL;
+}
+
+/*
+ * Empties one entry of the output cache, closing its file.
+ */
+void evict_output_cache(struct outputCacheEntry *entry) {
+    close(entry->fd);
+    free(entry->path);
+    entry->path = NULL;
+}
+
+/*
+ * Adds the memory and fds held by the output cache to held, for
+ * diagnostics mode.
+ */
+void output_cache_held(struct diagCounts *held) {
+    for (int i = 0; i < OUTPUT_CACHE_SIZE; i++) {
+        if (output_cache[i].path != NULL) {
+            diag_add_block(held, output_cache[i].path);
+            held->open_fds++;
+        }
+    }
+}
+
+/*
+ * Returns an fd for appending to filename, from the output cache. One
+ * stat() checks that the cached fd is still for the file the name points
+ * at now, which is a lot cheaper than opening and closing the file every
+ * time. If the file was renamed or deleted, the name points somewhere else
+ * (or nowhere), so the old entry is thrown out and the file is opened
+ * again. A new file goes into an empty entry, or replaces the least
+ * recently used one. The fd belongs to the cache: don't close it. Returns
+ * -1 if the file can't be opened.
+ */
+int cached_append_fd(const char *filename) {
+    struct stat st;
+    int exists = (stat(filename, &st) == 0);
+    output_cache_clock++;
+
+    for (int i = 0; i < OUTPUT_CACHE_SIZE; i++) {
+        struct outputCacheEntry *entry = &output_cache[i];
+        if (entry->path == NULL || strcmp(entry->path, filename) != 0) {
+            continue;
+        }
+        if (exists && entry->dev == st.st_dev && entry->ino == st.st_ino) {
+            entry->last_used = output_cache_clock;
+            return entry->fd;
+        }
+        // same name, different file
+        evict_output_cache(entry);
+    }
+
+    int fd = open(filename, O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        // only cache real files, not things like /dev/tty or a fifo
+        close(fd);
+        return -1;
+    }
+
+    struct outputCacheEntry *slot = &output_cache[0];
+    for (int i = 0; i < OUTPUT_CACHE_SIZE; i++) {
+        if (output_cache[i].path == NULL) {
+            slot = &output_cache[i];
+            break;
+        }
+        if (output_cache[i].last_used < slot->last_used) {
+            slot = &output_cache[i];
+        }
+    }
+    if (slot->path != NULL) {
+        evict_output_cache(slot);
+    }
+
+    slot->path = strdup(filename);
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->fd = fd;
+    slot->last_used = output_cache_clock;
+    return fd;
+}
+
+/*
+ * Opens the redirected output file for the shell itself to write to (memo
+ * and the builtin pipeline stages use this). ">" truncates the file and
+ * ">>" gets a copy of the fd from the output cache. Either way the caller
+ * closes the returned fd. Returns -1 if the file can't be opened.
+ */
+int open_output_file() {
+    int fd = -1;
+    if (fr_output->numOfSymbols == 2) {
+        int cached = cached_append_fd(fr_output->filename);
+        if (cached != -1) {
+            return fcntl(cached, F_DUPFD_CLOEXEC, 0);
+        }
+        fd = open(fr_output->filename,
+                  O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, 0666);
+    } else {
+        fd = open(fr_output->filename,
+                  O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0666);
+    }
+    if (fd == -1) {
+        perror("ERROR");
+    }
+    return fd;
+}
+
+/*
+ * Adds a background job to the job table and prints its number and process
+ * group. stages are the commands and pids the processes running them.
+ */
+void add_job(pid_t pgid, char ***stages, pid_t *pids, int count) {
+    struct job *job = NULL;
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (job_table[i].id == 0) {
+            job = &job_table[i];
+            break;
+        }
+    }
+    if (job == NULL) {
+        // table's full, the job still runs, we just can't show it.
+        // reap_jobs() still cleans up after it.
+        printf("[?] %d\n", pgid);
+        fflush(stdout);
+        return;
+    }
+
+    job->id = next_job_id++;
+    job->pgid = pgid;
+    job->count = count;
+    job->stages = calloc(count, sizeof(struct jobStage));
+    clock_gettime(CLOCK_MONOTONIC, &job->last_sample);
+
+    size_t length = 1;
+    for (int i = 0; i < count; i++) {
+        struct jobStage *stage = &job->stages[i];
+        stage->pid = pids[i];
+        stage->command = join_args(stages[i]);
+        stage->state = 'R';
+        // no sample yet, so nothing to work out rates from
+        stage->read_bytes = -1;
+        stage->read_rate = -1;
+        stage->write_rate = -1;
+        stage->in_queued = -1;
+        stage->in_capacity = -1;
+        length += strlen(stage->command) + 3;
+    }
+    job->command = malloc(length);
+    job->command[0] = '\0';
+    for (int i = 0; i < count; i++) {
+        if (i > 0) {
+            strcat(job->command, " | ");
+        }
+        strcat(job->command, job->stages[i].command);
+    }
+
+    printf("[%d] %d\n", job->id, pgid);
+    fflush(stdout);
+}
+
+/*
+ * Reaps every background process that has finished (so none of them stay
+ * around as zombies), and marks its stage in the job table as done.
+ */
+void reap_jobs() {
+    int wstatus;
+    pid_t pid;
+    while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+        for (int i = 0; i < MAX_JOBS; i++) {
+            for (int j = 0; job_table[i].id != 0 && j < job_table[i].count;
+                 j++) {
+                struct jobStage *stage = &job_table[i].stages[j];
+                if (stage->pid == pid) {
+                    stage->done = 1;
+                    stage->status = status_code(wstatus);
+                    stage->state = 'Z';
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Returns 1 if every stage of the job has finished.
+ */
+int job_finished(struct job *job) {
+    for (int i = 0; i < job->count; i++) {
+        if (!job->stages[i].done) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Prints "Done" for every background job that has finished since the last
+ * prompt, and takes it out of the job table.
+ */
+void report_finished_jobs() {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        struct job *job = &job_table[i];
+        if (job->id == 0 || !job_finished(job)) {
+            continue;
+        }
+
+        int status = job->stages[job->count - 1].status;
+        if (status == 0) {
+            printf("\n[%d] Done     %s", job->id, job->command);
+        } else {
+            printf("\n[%d] Exit %-3d %s", job->id, status, job->command);
+        }
+        fflush(stdout);
+
+        for (int j = 0; j < job->count; j++) {
+            free(job->stages[j].command);
+        }
+        free(job->stages);
+        free(job->command);
+        job->id = 0;
+    }
+}
+
+/*
+ * Adds the memory held by the job table to held, for diagnostics mode.
+ */
+void jobs_held(struct diagCounts *held) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        struct job *job = &job_table[i];
+        if (job->id == 0) {
+            continue;
+        }
+        for (int j = 0; j < job->count; j++) {
+            diag_add_block(held, job->stages[j].command);
+        }
+        diag_add_block(held, job->stages);
+        diag_add_block(held, job->command);
+    }
+}
+
+/*
+ * Reads a stage's state and CPU time (user + system, in clock ticks) from
+ * /proc/<pid>/stat. Returns 0, or -1 if the process is gone.
+ */
+int read_proc_stat(pid_t pid, char *state, unsigned long long *ticks) {
+    char path[64];
+    char text[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t n = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    text[n] = '\0';
+
+    // the command name is in parentheses and can have spaces in it, so
+    // start after the last ')'. Then the fields are: state, ppid, pgrp,
+    // session, tty_nr, tpgid, flags, minflt, cminflt, majflt, cmajflt,
+    // utime, stime.
+    char *p = strrchr(text, ')');
+    unsigned long long utime;
+    unsigned long long stime;
+    if (p == NULL ||
+        sscanf(p + 2, "%c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+               state, &utime, &stime) != 3) {
+        return -1;
+    }
+    *ticks = utime + stime;
+    return 0;
+}
+
+/*
+ * Reads how many bytes a stage has read and written in total, from
+ * /proc/<pid>/io. Sets both to -1 if they can't be read.
+ */
+void read_proc_io(pid_t pid, long long *read_bytes, long long *write_bytes) {
+    char path[64];
+    char text[1024];
+    *read_bytes = -1;
+    *write_bytes = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/io", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    ssize_t n = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    if (n <= 0) {
+        return;
+    }
+    text[n] = '\0';
+    sscanf(text, "rchar: %lld wchar: %lld", read_bytes, write_bytes);
+}
+
+/*
+ * Finds out how many bytes are waiting in the pipe a stage reads from
+ * (its stdin), and how big the pipe is. The shell closed its own ends of
+ * the pipes launch_job() made, so the pipe is opened again through
+ * /proc/<pid>/fd/0 just long enough to ask with FIONREAD. The shell is only
+ * a reader of the pipe for that moment, which doesn't change anything for
+ * the stages.
+ */
+void read_pipe_fill(pid_t pid, int *queued, int *capacity) {
+    char path[64];
+    *queued = -1;
+    *capacity = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/fd/0", pid);
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+        int n;
+        if (ioctl(fd, FIONREAD, &n) == 0) {
+            *queued = n;
+        }
+        *capacity = fcntl(fd, F_GETPIPE_SZ);
+    }
+    close(fd);
+}
+
+/*
+ * Takes a new sample of every stage of a job, and works out the rates
+ * since the last sample: CPU% (100 = one core), each stage's share of the
+ * CPU time the whole job used, and bytes read and written per second.
+ */
+void sample_job(struct job *job) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - job->last_sample.tv_sec) +
+                     (now.tv_nsec - job->last_sample.tv_nsec) / 1e9;
+    if (elapsed <= 0) {
+        elapsed = 1e-9;
+    }
+    double ticks_per_second = sysconf(_SC_CLK_TCK);
+
+    unsigned long long *used = malloc(sizeof(unsigned long long) * job->count);
+    unsigned long long total = 0;
+
+    for (int i = 0; i < job->count; i++) {
+        struct jobStage *stage = &job->stages[i];
+        used[i] = 0;
+        if (stage->done) {
+            stage->cpu_percent = 0;
+            stage->read_rate = 0;
+            stage->write_rate = 0;
+            stage->in_queued = -1;
+            continue;
+        }
+
+        unsigned long long ticks;
+        if (read_proc_stat(stage->pid, &stage->state, &ticks) == -1) {
+            stage->state = 'Z';
+            continue;
+        }
+        used[i] = ticks - stage->cpu_ticks;
+        total += used[i];
+        stage->cpu_ticks = ticks;
+        stage->cpu_percent = 100.0 * used[i] / ticks_per_second / elapsed;
+
+        long long read_bytes;
+        long long write_bytes;
+        read_proc_io(stage->pid, &read_bytes, &write_bytes);
+        if (read_bytes >= 0 && stage->read_bytes >= 0) {
+            stage->read_rate = (read_bytes - stage->read_bytes) / elapsed;
+            stage->write_rate = (write_bytes - stage->write_bytes) / elapsed;
+        } else {
+            stage->read_rate = -1;
+            stage->write_rate = -1;
+        }
+        stage->read_bytes = read_bytes;
+        stage->write_bytes = write_bytes;
+
+        if (i > 0) {
+            read_pipe_fill(stage->pid, &stage->in_queued,
+                           &stage->in_capacity);
+        }
+    }
+
+    for (int i = 0; i < job->count; i++) {
+        job->stages[i].cpu_share = (total > 0) ? 100.0 * used[i] / total : 0;
+    }
+    free(used);
+    job->last_sample = now;
+}
+
+/*
+ * Formats a rate in bytes per second as something short like "12.5M".
+ */
+void format_rate(char *text, size_t size, double rate) {
+    if (rate < 0) {
+        snprintf(text, size, "-");
+    } else if (rate >= 1024.0 * 1024 * 1024) {
+        snprintf(text, size, "%.1fG", rate / (1024.0 * 1024 * 1024));
+    } else if (rate >= 1024.0 * 1024) {
+        snprintf(text, size, "%.1fM", rate / (1024.0 * 1024));
+    } else if (rate >= 1024.0) {
+        snprintf(text, size, "%.1fK", rate / 1024.0);
+    } else {
+        snprintf(text, size, "%.0f", rate);
+    }
+}
+
+/*
+ * Prints one job and the last sample of each of its stages.
+ */
+void print_job_stats(struct job *job) {
+    printf("[%d] %-7s %s\n", job->id, job_finished(job) ? "Done" : "Running",
+           job->command);
+    printf("    %-5s %-8s %-5s %6s %6s %9s %9s %15s  %s\n", "STAGE", "PID",
+           "STATE", "CPU%", "SHARE", "READ/s", "WRITE/s", "IN-PIPE",
+           "COMMAND");
+
+    for (int i = 0; i < job->count; i++) {
+        struct jobStage *stage = &job->stages[i];
+        char read_rate[16];
+        char write_rate[16];
+        char pipe_fill[32];
+        format_rate(read_rate, sizeof(read_rate), stage->read_rate);
+        format_rate(write_rate, sizeof(write_rate), stage->write_rate);
+        if (stage->in_queued >= 0 && stage->in_capacity > 0) {
+            snprintf(pipe_fill, sizeof(pipe_fill), "%dK/%dK %3d%%",
+                     stage->in_queued / 1024, stage->in_capacity / 1024,
+                     (int) (100.0 * stage->in_queued / stage->in_capacity));
+        } else {
+            snprintf(pipe_fill, sizeof(pipe_fill), "-");
+        }
+
+        printf("    %-5d %-8d %-5c %6.1f %6.1f %9s %9s %15s  %s\n", i,
+               stage->pid, stage->state, stage->cpu_percent,
+               stage->cpu_share, read_rate, write_rate, pipe_fill,
+               stage->command);
+    }
+}
+
+/*
+ * Appends the last sample of every stage of a job to f as tab separated
+ * columns (see jtop_header() for the column names).
+ */
+void export_job_stats(FILE *f, struct job *job, double timestamp) {
+    for (int i = 0; i < job->count; i++) {
+        struct jobStage *stage = &job->stages[i];
+        fprintf(f, "%.3f\t%d\t%d\t%d\t%c\t%.1f\t%.1f\t%.0f\t%.0f\t%d\t%d\t%s\n",
+                timestamp, job->id, i, stage->pid, stage->state,
+                stage->cpu_percent, stage->cpu_share, stage->read_rate,
+                stage->write_rate, stage->in_queued, stage->in_capacity,
+                stage->command);
+    }
+}
+
+/*
+ * Writes the column names for export_job_stats() to f.
+ */
+void jtop_header(FILE *f) {
+    fprintf(f, "time\tjob\tstage\tpid\tstate\tcpu_percent\tcpu_share\t"
+               "read_bytes_per_s\twrite_bytes_per_s\tin_pipe_bytes\t"
+               "in_pipe_capacity\tcommand\n");
+}
+
+/*
+ * Checks if the first argument is the "jobs" or "jtop" builtin.
+ */
+int contains_jobs(char **argArray) {
+    if (argArray[0] != NULL && (strcmp(argArray[0], "jobs") == 0 ||
+                                strcmp(argArray[0], "jtop") == 0)) {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * The "jobs" and "jtop" builtins (see rule 15 at the top of the file).
+ *   jobs                    lists the background jobs
+ *   jobs -v                 samples every job once and shows the stats
+ *   jtop [-d SECS] [-n COUNT] [-o FILE]
+ *                           keeps sampling and redrawing until q is
+ *                           pressed, COUNT samples were shown, or every
+ *                           job is done, and appends each sample to FILE
+ * Returns 0, or 1 if the arguments were wrong.
+ */
+int jobsCommand(char **argArray) {
+    int top = (strcmp(argArray[0], "jtop") == 0);
+    int verbose = top;
+    double interval = 1.0;
+    long count = -1;
+    FILE *export = NULL;
+
+    for (int i = 1; argArray[i] != NULL; i++) {
+        if (!top && strcmp(argArray[i], "-v") == 0) {
+            verbose = 1;
+        } else if (top && strcmp(argArray[i], "-d") == 0 &&
+                   argArray[i + 1] != NULL) {
+            interval = atof(argArray[++i]);
+        } else if (top && strcmp(argArray[i], "-n") == 0 &&
+                   argArray[i + 1] != NULL) {
+            count = atol(argArray[++i]);
+        } else if (top && strcmp(argArray[i], "-o") == 0 &&
+                   argArray[i + 1] != NULL) {
+            if (export != NULL) {
+                fclose(export);
+            }
+            export = fopen(argArray[++i], "a");
+            if (export == NULL) {
+                perror("ERROR");
+                return 1;
+            }
+            // a new file gets the column names first
+            if (ftell(export) == 0) {
+                jtop_header(export);
+            }
+        } else {
+            argError();
+            if (export != NULL) {
+                fclose(export);
+            }
+            return 1;
+        }
+    }
+    if (interval < 0.1) {
+        interval = 0.1;
+    }
+
+    reap_jobs();
+
+    if (!verbose) {
+        for (int i = 0; i < MAX_JOBS; i++) {
+            if (job_table[i].id != 0) {
+                printf("[%d] %-7s %s\n", job_table[i].id,
+                       job_finished(&job_table[i]) ? "Done" : "Running",
+                       job_table[i].command);
+            }
+        }
+        fflush(stdout);
+        return 0;
+    }
+
+    // jtop reads single keys, so take the terminal out of canonical mode
+    // while it runs
+    struct termios cooked;
+    if (top && shell_interactive) {
+        struct termios raw;
+        tcgetattr(0, &cooked);
+        raw = cooked;
+        raw.c_lflag &= ~(ICANON | ECHO | ISIG);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(0, TCSADRAIN, &raw);
+    }
+
+    for (long shown = 0; count < 0 || shown < count; shown++) {
+        reap_jobs();
+
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        double timestamp = now.tv_sec + now.tv_nsec / 1e9;
+
+        if (top && shell_interactive) {
+            // clear the screen and go to the top left corner
+            printf("\033[H\033[2J");
+        }
+        int running = 0;
+        for (int i = 0; i < MAX_JOBS; i++) {
+            struct job *job = &job_table[i];
+            if (job->id == 0) {
+                continue;
+            }
+            sample_job(job);
+            print_job_stats(job);
+            if (export != NULL) {
+                export_job_stats(export, job, timestamp);
+            }
+            running += !job_finished(job);
+        }
+        if (running == 0 && shown == 0) {
+            printf("No running jobs.\n");
+        }
+        if (top && shell_interactive) {
+            printf("\n(q to quit)\n");
+        }
+        fflush(stdout);
+        if (export != NULL) {
+            fflush(export);
+        }
+
+        if (!top || running == 0 || (count >= 0 && shown + 1 >= count)) {
+            break;
+        }
+
+        // wait for the next sample, or a key press
+        struct pollfd key = {0, POLLIN, 0};
+        if (shell_interactive &&
+            poll(&key, 1, (int) (interval * 1000)) == 1) {
+            char c;
+            if (read(0, &c, 1) == 1 && (c == 'q' || c == 3)) {
+                break;
+            }
+        } else if (!shell_interactive) {
+            poll(NULL, 0, (int) (interval * 1000));
+        }
+    }
+
+    if (top && shell_interactive) {
+        tcsetattr(0, TCSADRAIN, &cooked);
+    }
+    if (export != NULL) {
+        fclose(export);
+    }
+    return 0;
+}
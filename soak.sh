@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+# Soak test for the shell's diagnostics mode (rule 10 at the top of
+# shell.c). Builds the shell, feeds it LINES mixed command lines (a million
+# by default) with "-d", and fails if the shell aborts because memory or fd
+# counts drifted, or exits with anything but 0.
+#
+#   Usage: ./soak.sh [LINES]
+#
+# Everything happens in a temp directory, so it doesn't touch your rc file
+# or memo cache. The last few diagnostics lines are printed either way.
+
+LINES=${1:-1000000}
+CC=${CC:-gcc}
+
+here=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d "${TMPDIR:-/tmp}/soak.XXXXXX") || exit 1
+trap 'rm -rf "$work"' EXIT
+
+$CC -O2 -o "$work/a.out" "$here/shell.c" -lpthread || exit 1
+
+mkdir "$work/dir"
+touch "$work/dir/one.txt" "$work/dir/two.txt"
+seq 1 1000 > "$work/numbers.txt"
+: > "$work/rc"
+
+# one block of mixed lines, repeated with a counter until there are LINES
+# of them. The counter makes new aliases, functions and ">>" files keep
+# turning up, so the shell's tables grow and shrink all through the run.
+awk -v lines="$LINES" -v work="$work" 'BEGIN {
+    n = 0
+    for (i = 0; n < lines; i++) {
+        block[0] = "echo " i
+        block[1] = "ls " work "/dir | wc -l"
+        block[2] = "cat < " work "/numbers.txt | grep 7 | head -n 3"
+        block[3] = "echo " i " >> " work "/out" (i % 12) ".txt"
+        block[4] = "echo " i " > " work "/last.txt"
+        block[5] = "alias a" (i % 50) "=ls -1 " work "/dir"
+        block[6] = "a" (i % 50)
+        block[7] = "function f" (i % 50) " echo $1 ; echo $?"
+        block[8] = "f" (i % 50) " " i
+        block[9] = "memo seq 1 " (i % 20) " | wc -l"
+        block[10] = "seq 1 " (i % 100) " | grep 1 | wc -c"
+        block[11] = "true &"
+        block[12] = "jobs"
+        block[13] = "false | true"
+        block[14] = "echo $? $PIPESTATUS"
+        block[15] = (i % 2) ? "set -o fastpipe" : "set +o fastpipe"
+        block[16] = "cd " work "/dir"
+        block[17] = "cd .."
+        block[18] = "nosuchcommand"
+        block[19] = "ls " work "/nothing/here"
+        for (j = 0; j < 20 && n < lines; j++) {
+            print block[j]
+            n++
+        }
+    }
+    print "exit"
+}' > "$work/commands.txt"
+
+echo "soak: running $LINES lines"
+MEMO_DIR="$work/memo" MYSHELL_RC="$work/rc" \
+    "$work/a.out" -d < "$work/commands.txt" > /dev/null 2> "$work/diag.txt"
+status=$?
+
+grep '^\[diag\]' "$work/diag.txt" | tail -n 3
+if [ $status -ne 0 ]; then
+    echo "soak: FAILED, the shell exited with $status"
+    exit 1
+fi
+echo "soak: passed"